@@ -0,0 +1,488 @@
+// Асинхронный генератор нагрузки на Boost.Beast.
+// Заполняет сервис набором ссылок через /makeshort/batch, затем держит
+// --connections keep-alive соединений и шлёт смесь shorten/resolve, где коды
+// для resolve выбираются по распределению Ципфа. В конце печатает RPS и
+// перцентили задержки p50/p99/p999. С --requests-per-connection N соединение
+// закрывается после N запросов и открывается заново — шквал подключений для
+// проверки приёма соединений; время подключения печатается отдельно.
+// С --binary-port запросы идут по бинарному протоколу сервиса, по --pipeline
+// кадров за одну запись на соединение.
+#include <boost/asio.hpp>
+#include <boost/beast.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace net = boost::asio;
+using tcp = boost::asio::ip::tcp;
+
+struct Options {
+    std::string host = "127.0.0.1";
+    std::string port = "8080";
+    int connections = 64;
+    int threads = 1;
+    int duration_seconds = 10;
+    int keys = 10000;
+    double zipf_exponent = 1.1;
+    double shorten_ratio = 0.05;
+    // 0 — keep-alive без ограничения числа запросов
+    int requests_per_connection = 0;
+    // Пусто — HTTP; иначе порт бинарного протокола (binary_port сервиса)
+    std::string binary_port;
+    int pipeline = 1;
+};
+
+class ZipfSampler {
+public:
+    ZipfSampler(std::size_t keys, double exponent) : cdf_(keys) {
+        double total = 0.0;
+        for (std::size_t i = 0; i < keys; ++i) {
+            total += 1.0 / std::pow(static_cast<double>(i + 1), exponent);
+            cdf_[i] = total;
+        }
+        for (double& value : cdf_) {
+            value /= total;
+        }
+    }
+
+    template <typename Generator>
+    std::size_t operator()(Generator& gen) const {
+        const double u = std::uniform_real_distribution<double>(0.0, 1.0)(gen);
+        const auto it = std::lower_bound(cdf_.begin(), cdf_.end(), u);
+        return std::min<std::size_t>(it - cdf_.begin(), cdf_.size() - 1);
+    }
+
+private:
+    std::vector<double> cdf_;
+};
+
+struct Stats {
+    std::vector<std::int64_t> shorten_ns;
+    std::vector<std::int64_t> resolve_ns;
+    std::vector<std::int64_t> connect_ns;
+    std::uint64_t errors = 0;
+};
+
+class Worker : public std::enable_shared_from_this<Worker> {
+public:
+    Worker(net::io_context& ioc, const tcp::resolver::results_type& endpoints, const Options& options,
+           const std::vector<std::string>& codes, const ZipfSampler& sampler,
+           std::chrono::steady_clock::time_point deadline, int id)
+        : stream_(net::make_strand(ioc))
+        , endpoints_(endpoints)
+        , options_(options)
+        , codes_(codes)
+        , sampler_(sampler)
+        , deadline_(deadline)
+        , id_(id)
+        , gen_(std::random_device{}()) {}
+
+    void start() {
+        connect();
+    }
+
+    const Stats& stats() const { return stats_; }
+
+private:
+    beast::tcp_stream stream_;
+    tcp::resolver::results_type endpoints_;
+    const Options& options_;
+    const std::vector<std::string>& codes_;
+    const ZipfSampler& sampler_;
+    std::chrono::steady_clock::time_point deadline_;
+    int id_;
+    std::mt19937_64 gen_;
+    beast::flat_buffer buffer_;
+    http::request<http::empty_body> request_;
+    http::response<http::string_body> response_;
+    std::chrono::steady_clock::time_point sent_;
+    bool shorten_ = false;
+    std::uint64_t sequence_ = 0;
+    int served_ = 0;
+    Stats stats_;
+
+    void connect() {
+        stream_.expires_after(std::chrono::seconds(5));
+        const auto started = std::chrono::steady_clock::now();
+        auto self = shared_from_this();
+        stream_.async_connect(endpoints_, [self, started](beast::error_code ec, const tcp::endpoint&) {
+            if (ec) {
+                ++self->stats_.errors;
+                return;
+            }
+            self->stats_.connect_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - started).count());
+            self->served_ = 0;
+            self->sendNext();
+        });
+    }
+
+    void sendNext() {
+        if (std::chrono::steady_clock::now() >= deadline_) {
+            beast::error_code ec;
+            stream_.socket().shutdown(tcp::socket::shutdown_both, ec);
+            return;
+        }
+
+        shorten_ = std::uniform_real_distribution<double>(0.0, 1.0)(gen_) < options_.shorten_ratio;
+        std::string target = shorten_
+            ? "/makeshort/https://loadgen.example/" + std::to_string(id_) + "/" + std::to_string(gen_())
+                  + "/" + std::to_string(sequence_++)
+            : "/" + codes_[sampler_(gen_)];
+
+        request_ = {http::verb::get, target, 11};
+        request_.set(http::field::host, options_.host);
+        // Последний запрос соединения просит сервер закрыть его
+        request_.keep_alive(options_.requests_per_connection == 0 || served_ + 1 < options_.requests_per_connection);
+        response_ = {};
+
+        sent_ = std::chrono::steady_clock::now();
+        stream_.expires_after(std::chrono::seconds(10));
+        auto self = shared_from_this();
+        http::async_write(stream_, request_, [self](beast::error_code ec, std::size_t) {
+            if (ec) {
+                ++self->stats_.errors;
+                return;
+            }
+            http::async_read(self->stream_, self->buffer_, self->response_,
+                [self](beast::error_code ec, std::size_t) {
+                    self->onResponse(ec);
+                });
+        });
+    }
+
+    void onResponse(beast::error_code ec) {
+        if (ec) {
+            ++stats_.errors;
+            // Сервер мог закрыть соединение — переподключаемся
+            beast::error_code ignored;
+            stream_.socket().close(ignored);
+            buffer_.clear();
+            if (std::chrono::steady_clock::now() < deadline_) {
+                connect();
+            }
+            return;
+        }
+
+        const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - sent_).count();
+        if (response_.result_int() >= 400) {
+            ++stats_.errors;
+        } else {
+            (shorten_ ? stats_.shorten_ns : stats_.resolve_ns).push_back(elapsed);
+        }
+        ++served_;
+
+        if (!response_.keep_alive()) {
+            beast::error_code ignored;
+            stream_.socket().close(ignored);
+            buffer_.clear();
+            connect();
+            return;
+        }
+        sendNext();
+    }
+};
+
+// Кадр: u32 длина остатка, u32 id, u8 код операции (в ответе — статус), нагрузка
+class BinaryWorker : public std::enable_shared_from_this<BinaryWorker> {
+public:
+    BinaryWorker(net::io_context& ioc, const tcp::resolver::results_type& endpoints, const Options& options,
+                 const std::vector<std::string>& codes, const ZipfSampler& sampler,
+                 std::chrono::steady_clock::time_point deadline, int id)
+        : stream_(net::make_strand(ioc))
+        , endpoints_(endpoints)
+        , options_(options)
+        , codes_(codes)
+        , sampler_(sampler)
+        , deadline_(deadline)
+        , id_(id)
+        , gen_(std::random_device{}())
+        , shorten_(options.pipeline) {}
+
+    void start() {
+        stream_.expires_after(std::chrono::seconds(5));
+        auto self = shared_from_this();
+        stream_.async_connect(endpoints_, [self](beast::error_code ec, const tcp::endpoint&) {
+            if (ec) {
+                ++self->stats_.errors;
+                return;
+            }
+            self->stream_.socket().set_option(tcp::no_delay(true), ec);
+            self->sendBatch();
+        });
+    }
+
+    const Stats& stats() const { return stats_; }
+
+private:
+    beast::tcp_stream stream_;
+    tcp::resolver::results_type endpoints_;
+    const Options& options_;
+    const std::vector<std::string>& codes_;
+    const ZipfSampler& sampler_;
+    std::chrono::steady_clock::time_point deadline_;
+    int id_;
+    std::mt19937_64 gen_;
+    std::string out_;
+    beast::flat_buffer buffer_;
+    // Тип запроса по id внутри пачки
+    std::vector<bool> shorten_;
+    int remaining_ = 0;
+    std::chrono::steady_clock::time_point sent_;
+    std::uint64_t sequence_ = 0;
+    Stats stats_;
+
+    static void append(std::string& out, std::uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            out += static_cast<char>((value >> (8 * i)) & 0xFF);
+        }
+    }
+
+    static std::uint32_t read(const char* data) {
+        std::uint32_t value = 0;
+        for (int i = 0; i < 4; ++i) {
+            value |= std::uint32_t{static_cast<unsigned char>(data[i])} << (8 * i);
+        }
+        return value;
+    }
+
+    void sendBatch() {
+        if (std::chrono::steady_clock::now() >= deadline_) {
+            beast::error_code ec;
+            stream_.socket().shutdown(tcp::socket::shutdown_both, ec);
+            return;
+        }
+
+        out_.clear();
+        for (int i = 0; i < options_.pipeline; ++i) {
+            shorten_[i] = std::uniform_real_distribution<double>(0.0, 1.0)(gen_) < options_.shorten_ratio;
+            const std::string payload = shorten_[i]
+                ? "https://loadgen.example/" + std::to_string(id_) + "/" + std::to_string(gen_())
+                      + "/" + std::to_string(sequence_++)
+                : codes_[sampler_(gen_)];
+            append(out_, static_cast<std::uint32_t>(5 + payload.size()));
+            append(out_, static_cast<std::uint32_t>(i));
+            out_ += static_cast<char>(shorten_[i] ? 1 : 2);
+            out_ += payload;
+        }
+        remaining_ = options_.pipeline;
+
+        sent_ = std::chrono::steady_clock::now();
+        stream_.expires_after(std::chrono::seconds(10));
+        auto self = shared_from_this();
+        net::async_write(stream_, net::buffer(out_), [self](beast::error_code ec, std::size_t) {
+            if (ec) {
+                ++self->stats_.errors;
+                return;
+            }
+            self->readResponses();
+        });
+    }
+
+    void readResponses() {
+        auto self = shared_from_this();
+        stream_.async_read_some(buffer_.prepare(65536), [self](beast::error_code ec, std::size_t bytes) {
+            if (ec) {
+                ++self->stats_.errors;
+                return;
+            }
+            self->buffer_.commit(bytes);
+            self->parseResponses();
+        });
+    }
+
+    void parseResponses() {
+        const auto now = std::chrono::steady_clock::now();
+        while (buffer_.size() >= 4) {
+            const char* data = static_cast<const char*>(buffer_.data().data());
+            const std::uint32_t length = read(data);
+            if (buffer_.size() < 4 + length) {
+                break;
+            }
+            const std::uint32_t id = read(data + 4);
+            const auto status = static_cast<unsigned char>(data[8]);
+            if (status != 0 || id >= shorten_.size()) {
+                ++stats_.errors;
+            } else {
+                (shorten_[id] ? stats_.shorten_ns : stats_.resolve_ns).push_back(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(now - sent_).count());
+            }
+            buffer_.consume(4 + length);
+            --remaining_;
+        }
+        if (remaining_ > 0) {
+            readResponses();
+        } else {
+            sendBatch();
+        }
+    }
+};
+
+std::vector<std::string> populate(net::io_context& ioc, const tcp::resolver::results_type& endpoints,
+                                  const Options& options) {
+    std::vector<std::string> codes;
+    beast::tcp_stream stream(ioc);
+    stream.connect(endpoints);
+
+    const int chunk = 1000;
+    for (int begin = 0; begin < options.keys; begin += chunk) {
+        http::request<http::string_body> request{http::verb::post, "/makeshort/batch", 11};
+        request.set(http::field::host, options.host);
+        request.set(http::field::content_type, "text/plain");
+        request.keep_alive(true);
+        for (int i = begin; i < std::min(options.keys, begin + chunk); ++i) {
+            request.body() += "https://loadgen.example/key/" + std::to_string(i) + "\n";
+        }
+        request.prepare_payload();
+        http::write(stream, request);
+
+        beast::flat_buffer buffer;
+        http::response<http::string_body> response;
+        http::read(stream, buffer, response);
+        if (response.result() != http::status::ok) {
+            throw std::runtime_error("Batch shorten failed: " + response.body());
+        }
+
+        std::string_view body = response.body();
+        while (!body.empty()) {
+            const auto end = body.find('\n');
+            const std::string_view line = body.substr(0, end);
+            codes.emplace_back(line.substr(line.rfind('/') + 1));
+            body = end == std::string_view::npos ? std::string_view{} : body.substr(end + 1);
+        }
+    }
+
+    beast::error_code ec;
+    stream.socket().shutdown(tcp::socket::shutdown_both, ec);
+    return codes;
+}
+
+double percentileMs(std::vector<std::int64_t>& samples, double percentile) {
+    if (samples.empty()) {
+        return 0.0;
+    }
+    const std::size_t index = std::min(samples.size() - 1,
+        static_cast<std::size_t>(percentile * static_cast<double>(samples.size())));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index] / 1e6;
+}
+
+void report(const std::string& name, std::vector<std::int64_t>& samples, double seconds) {
+    std::cout << std::left << std::setw(8) << name
+              << " requests=" << samples.size()
+              << std::fixed << std::setprecision(0) << " rps=" << samples.size() / seconds
+              << std::setprecision(3)
+              << " p50=" << percentileMs(samples, 0.50) << "ms"
+              << " p99=" << percentileMs(samples, 0.99) << "ms"
+              << " p999=" << percentileMs(samples, 0.999) << "ms" << std::endl;
+}
+
+Options parseOptions(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::string name = argv[i];
+        const std::string value = argv[i + 1];
+        if (name == "--host") options.host = value;
+        else if (name == "--port") options.port = value;
+        else if (name == "--connections") options.connections = std::stoi(value);
+        else if (name == "--threads") options.threads = std::stoi(value);
+        else if (name == "--duration") options.duration_seconds = std::stoi(value);
+        else if (name == "--keys") options.keys = std::stoi(value);
+        else if (name == "--zipf") options.zipf_exponent = std::stod(value);
+        else if (name == "--shorten-ratio") options.shorten_ratio = std::stod(value);
+        else if (name == "--requests-per-connection") options.requests_per_connection = std::stoi(value);
+        else if (name == "--binary-port") options.binary_port = value;
+        else if (name == "--pipeline") options.pipeline = std::stoi(value);
+        else throw std::invalid_argument("Unknown option: " + name);
+    }
+    if (options.keys <= 0 || options.connections <= 0 || options.threads <= 0 || options.requests_per_connection < 0
+            || options.pipeline <= 0) {
+        throw std::invalid_argument("--keys, --connections, --threads and --pipeline must be positive");
+    }
+    return options;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        const Options options = parseOptions(argc, argv);
+
+        net::io_context ioc{options.threads};
+        tcp::resolver resolver(ioc);
+        const auto endpoints = resolver.resolve(options.host, options.port);
+
+        std::cout << "Populating " << options.keys << " keys..." << std::endl;
+        const std::vector<std::string> codes = populate(ioc, endpoints, options);
+        const ZipfSampler sampler(codes.size(), options.zipf_exponent);
+
+        std::cout << "Running " << options.connections << " connections for "
+                  << options.duration_seconds << "s (zipf=" << options.zipf_exponent
+                  << ", shorten ratio=" << options.shorten_ratio << ")..." << std::endl;
+
+        const auto started = std::chrono::steady_clock::now();
+        const auto deadline = started + std::chrono::seconds(options.duration_seconds);
+        std::vector<std::shared_ptr<Worker>> workers;
+        std::vector<std::shared_ptr<BinaryWorker>> binary_workers;
+        const auto binary_endpoints = options.binary_port.empty()
+            ? tcp::resolver::results_type{} : resolver.resolve(options.host, options.binary_port);
+        for (int i = 0; i < options.connections; ++i) {
+            if (options.binary_port.empty()) {
+                workers.push_back(std::make_shared<Worker>(ioc, endpoints, options, codes, sampler, deadline, i));
+                workers.back()->start();
+            } else {
+                binary_workers.push_back(
+                    std::make_shared<BinaryWorker>(ioc, binary_endpoints, options, codes, sampler, deadline, i));
+                binary_workers.back()->start();
+            }
+        }
+
+        std::vector<std::thread> threads;
+        for (int i = 1; i < options.threads; ++i) {
+            threads.emplace_back([&ioc] { ioc.run(); });
+        }
+        ioc.run();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+        Stats total;
+        const auto merge = [&total](const Stats& stats) {
+            total.shorten_ns.insert(total.shorten_ns.end(), stats.shorten_ns.begin(), stats.shorten_ns.end());
+            total.resolve_ns.insert(total.resolve_ns.end(), stats.resolve_ns.begin(), stats.resolve_ns.end());
+            total.connect_ns.insert(total.connect_ns.end(), stats.connect_ns.begin(), stats.connect_ns.end());
+            total.errors += stats.errors;
+        };
+        for (const auto& worker : workers) {
+            merge(worker->stats());
+        }
+        for (const auto& worker : binary_workers) {
+            merge(worker->stats());
+        }
+        std::vector<std::int64_t> all = total.shorten_ns;
+        all.insert(all.end(), total.resolve_ns.begin(), total.resolve_ns.end());
+
+        report("total", all, seconds);
+        report("resolve", total.resolve_ns, seconds);
+        report("shorten", total.shorten_ns, seconds);
+        report("connect", total.connect_ns, seconds);
+        std::cout << "errors=" << total.errors << std::endl;
+
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
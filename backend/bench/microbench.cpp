@@ -0,0 +1,154 @@
+// Микробенчмарки горячих путей сервиса на Google Benchmark.
+#define URL_SHORTENER_NO_MAIN
+#include "../main.cpp"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdio>
+
+namespace {
+
+const std::string BENCH_DB_PATH = "bench_urls.db";
+
+// Общая база на все бенчмарки SqliteStorage: заполняется один раз
+SqliteStorage& benchDatabase(std::vector<std::string>& codes) {
+    static std::vector<std::string> stored_codes;
+    static std::unique_ptr<SqliteStorage> db = [] {
+        std::remove(BENCH_DB_PATH.c_str());
+        std::remove((BENCH_DB_PATH + "-wal").c_str());
+        std::remove((BENCH_DB_PATH + "-shm").c_str());
+        auto database = std::make_unique<SqliteStorage>(BENCH_DB_PATH);
+
+        std::vector<std::string> urls;
+        for (int i = 0; i < 10000; ++i) {
+            urls.push_back("https://example.com/bench/" + std::to_string(i));
+        }
+        std::promise<std::vector<std::string>> result;
+        database->shortenUrlsAsync(urls, 0, [&result](std::vector<std::string> short_codes, std::exception_ptr error) {
+            if (error) {
+                result.set_exception(error);
+            } else {
+                result.set_value(std::move(short_codes));
+            }
+        });
+        stored_codes = result.get_future().get();
+        return database;
+    }();
+    codes = stored_codes;
+    return *db;
+}
+
+void BM_CodeGeneratorRandom(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(CodeGenerator::generate());
+    }
+}
+BENCHMARK(BM_CodeGeneratorRandom);
+
+void BM_CodeGeneratorSequence(benchmark::State& state) {
+    SequenceCodeGenerator generator(0x5eed);
+    std::uint64_t id = 1;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(generator.generate(id++));
+    }
+}
+BENCHMARK(BM_CodeGeneratorSequence);
+
+void BM_UrlDecode(benchmark::State& state) {
+    const std::string encoded =
+        "https%3A%2F%2Fexample.com%2Fsearch%3Fq%3Durl+shortener%26utm_source%3Dnewsletter%26utm_medium%3Demail";
+    std::string decoded;
+    for (auto _ : state) {
+        urlDecode(encoded, decoded);
+        benchmark::DoNotOptimize(decoded.data());
+    }
+    state.SetBytesProcessed(state.iterations() * encoded.size());
+}
+BENCHMARK(BM_UrlDecode);
+
+void BM_RouterMatch(benchmark::State& state) {
+    const std::array<std::string_view, 4> targets = {
+        "/Ab3F9Ks", "/makeshort/https://google.com", "/health", "/favicon.ico"};
+    std::size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Router::match(http::verb::get, targets[i++ % targets.size()]));
+    }
+}
+BENCHMARK(BM_RouterMatch);
+
+void BM_GetOriginalUrlCached(benchmark::State& state) {
+    std::vector<std::string> codes;
+    SqliteStorage& db = benchDatabase(codes);
+    std::size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.getOriginalUrl(codes[i++ % 256]));
+    }
+}
+BENCHMARK(BM_GetOriginalUrlCached)->ThreadRange(1, 4);
+
+void BM_GetOriginalUrlUnknown(benchmark::State& state) {
+    std::vector<std::string> codes;
+    SqliteStorage& db = benchDatabase(codes);
+    std::uint64_t i = 0;
+    SequenceCodeGenerator generator(0xbad);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.getOriginalUrl(generator.generate(i++)));
+    }
+}
+BENCHMARK(BM_GetOriginalUrlUnknown);
+
+void BM_GetOriginalUrlsBatch(benchmark::State& state) {
+    std::vector<std::string> codes;
+    SqliteStorage& db = benchDatabase(codes);
+    codes.resize(static_cast<std::size_t>(state.range(0)));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.getOriginalUrls(codes));
+    }
+    state.SetItemsProcessed(state.iterations() * codes.size());
+}
+BENCHMARK(BM_GetOriginalUrlsBatch)->Arg(16)->Arg(256);
+
+void BM_MemoryStorageLookup(benchmark::State& state) {
+    static std::unique_ptr<MemoryStorage> filled = [] {
+        auto memory = std::make_unique<MemoryStorage>(100000);
+        for (int i = 0; i < 100000; ++i) {
+            memory->shortenUrl("https://example.com/memory/" + std::to_string(i));
+        }
+        return memory;
+    }();
+    MemoryStorage& storage = *filled;
+    std::vector<std::string> codes;
+    for (int i = 0; i < 256; ++i) {
+        codes.push_back(storage.shortenUrl("https://example.com/memory/" + std::to_string(i * 389)));
+    }
+    std::string original_url;
+    std::size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(storage.tryGetOriginalUrl(codes[i++ % codes.size()], original_url));
+    }
+}
+BENCHMARK(BM_MemoryStorageLookup)->ThreadRange(1, 4);
+
+void BM_ShortenUrlExisting(benchmark::State& state) {
+    std::vector<std::string> codes;
+    SqliteStorage& db = benchDatabase(codes);
+    std::size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.shortenUrl("https://example.com/bench/" + std::to_string(i++ % 10000)));
+    }
+}
+BENCHMARK(BM_ShortenUrlExisting)->UseRealTime();
+
+void BM_ShortenUrlNew(benchmark::State& state) {
+    std::vector<std::string> codes;
+    SqliteStorage& db = benchDatabase(codes);
+    static std::atomic<std::uint64_t> counter{0};
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.shortenUrl("https://example.com/new/" + std::to_string(counter++)));
+    }
+}
+BENCHMARK(BM_ShortenUrlNew)->UseRealTime()->ThreadRange(1, 8);
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -5,249 +5,5818 @@
 #include <string>
 #include <random>
 #include <memory>
-#include <regex>
+#include <mutex>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <map>
+#include <string_view>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <numeric>
+#include <sstream>
+#include <tuple>
+#include <atomic>
+#include <cstdint>
+#include <cmath>
+#include <optional>
+#include <shared_mutex>
+#include <cstring>
+#include <cctype>
+#include <charconv>
+#include <cstdlib>
+#include <type_traits>
+#include <cstdio>
+#include <cerrno>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace beast = boost::beast;
 namespace http = beast::http;
 namespace net = boost::asio;
 using tcp = boost::asio::ip::tcp;
 
-const std::string SHORT_DOMAIN = "afobeus.ru";
-const int SHORT_CODE_LENGTH = 7;
-const int SERVER_PORT = 8080;
+// Настройки SQLite, применяемые к каждому соединению при открытии
+struct PragmaProfile {
+    std::string journal_mode = "WAL";
+    std::string synchronous = "NORMAL";
+    std::int64_t mmap_size = 256ll * 1024 * 1024;
+    // Отрицательное значение — размер в КиБ, а не в страницах
+    int cache_size = -64 * 1024;
+    std::string temp_store = "MEMORY";
+    int busy_timeout_ms = 5000;
+};
+
+// Random — случайные коды с повтором при коллизии;
+// Sequence — перемешанный base62 от id строки, коллизий не бывает
+enum class CodeGeneratorMode {
+    Random,
+    Sequence
+};
+// Sqlite — urls.db на диске; Memory — только в памяти процесса (edge-узлы);
+// Snapshot — read-only реплика из snapshot_path (см. export-snapshot)
+enum class StorageEngine {
+    Sqlite,
+    Memory,
+    Snapshot,
+};
+// Off — кэш наполняется только запросами; Recent — при старте читаются
+// последние созданные ссылки, Clicks — самые посещаемые по таблице clicks
+enum class CacheWarmup {
+    Off,
+    Recent,
+    Clicks,
+};
+
+// Token bucket на пару (клиент, маршрут): пополнение в секунду и ёмкость.
+// per_second = 0 — маршрут без ограничения
+struct RateLimit {
+    double per_second = 0;
+    double burst = 0;
+
+    bool operator==(const RateLimit& other) const {
+        return per_second == other.per_second && burst == other.burst;
+    }
+};
+
+constexpr std::string_view CODE_ALPHABET =
+    "abcdefghijklmnopqrstuvwxyz"
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+    "0123456789";
+
+// Коды хранятся в массивах фиксированного размера (снимок, кольцо кликов,
+// хранилище в памяти); 62^8 помещается в 64 бита
+constexpr int MAX_SHORT_CODE_LENGTH = 8;
+// Ёмкость кольца событий одного потока, степень двойки
+constexpr std::size_t CLICK_RING_CAPACITY = 4096;
+constexpr std::size_t CLICK_REFERRER_MAX = 64;
+constexpr std::size_t RATE_LIMIT_PROBE = 8;
+// Кадр бинарного протокола: u32 длина остатка кадра, u32 id запроса, u8 код
+// операции (в ответе — статус), затем полезная нагрузка. Длина заголовка —
+// без поля длины, поэтому это и наименьшая длина кадра.
+constexpr std::size_t BINARY_HEADER_SIZE = 5;
+// Запрос пришёл от другого узла: отвечаем локально, не пересылая дальше
+const std::string CLUSTER_FORWARDED_HEADER = "X-Cluster-Forwarded";
+// Срок жизни ссылки при сокращении: секунды от текущего момента или unix-время
+const std::string LINK_TTL_HEADER = "X-Link-TTL";
+const std::string LINK_EXPIRES_AT_HEADER = "X-Link-Expires-At";
+// Снимок хранит срок ссылки в 32 битах
+constexpr std::int64_t MAX_LINK_EXPIRES_AT = UINT32_MAX;
+
+// Все настраиваемые параметры сервиса. Значения по умолчанию перекрываются
+// файлом (--config=<path> или URL_SHORTENER_CONFIG), затем переменными
+// окружения URL_SHORTENER_<ИМЯ>, затем аргументами --<имя>=<значение>.
+// Имена ключей — имена полей; список ключей — в configOptions().
+struct Config {
+    std::string short_domain = "afobeus.ru";
+    int short_code_length = 7;
+    unsigned short server_port = 8080;
+    // "0.0.0.0" — все адреса IPv4; "::" — IPv6 и IPv4 на одном сокете (dual-stack)
+    std::string listen_address = "0.0.0.0";
+    int listen_backlog = net::socket_base::max_listen_connections;
+    // Число слушающих сокетов на порт с SO_REUSEPORT: ядро само распределяет
+    // соединения между ними; 0 — по числу worker_threads. При нескольких
+    // сокетах у каждого свой поток и io_context, где живут и его сессии. Выключено по
+    // умолчанию: с SO_REUSEPORT второй экземпляр на том же порту не получит
+    // "address in use", а молча поделит соединения с первым
+    unsigned acceptors = 1;
+    // Сколько соединений принимать за одно пробуждение: после async_accept
+    // очередь listen дочитывается неблокирующим accept до would_block
+    std::size_t accept_batch = 16;
+    bool tcp_nodelay = true;
+    // Длина очереди TCP Fast Open на слушающем сокете; 0 — выключено
+    int tcp_fastopen_queue = 0;
+    // Порт бинарного протокола для внутренних сервисов (BinarySession); 0 — выключен
+    unsigned short binary_port = 0;
+    // Сверх стольких запросов соединения в обработке чтение приостанавливается,
+    // пока не уйдут ответы
+    std::size_t binary_max_inflight = 256;
+    std::uint32_t binary_frame_limit = 64 * 1024;
+    // 0 — по числу ядер (std::thread::hardware_concurrency)
+    unsigned worker_threads = 0;
+    // Потоки, выполняющие чтения SQLite вне потоков ввода-вывода; 0 — по числу ядер
+    unsigned db_read_threads = 0;
+    // 0 — GET /<code> отдаёт исходный URL в теле text/plain;
+    // 301/302/307/308 — бэкенд сам отвечает редиректом с заголовком Location
+    unsigned redirect_status = 0;
+    std::string redirect_cache_control = "public, max-age=86400";
+    // Сроки фаз запроса: ожидание первого байта (keep-alive), чтение заголовка
+    // с первого байта, чтение тела после заголовка, запись ответа. Срок фазы
+    // общий, а не на каждый read, поэтому медленный клиент его не продлевает.
+    std::chrono::seconds session_idle_timeout{30};
+    std::chrono::seconds session_header_timeout{10};
+    std::chrono::seconds session_body_timeout{30};
+    std::chrono::seconds session_write_timeout{30};
+    // Сверх лимитов сессия отвечает 431/413 и закрывает соединение
+    std::uint32_t session_header_limit = 8 * 1024;
+    std::uint64_t session_body_limit = 1024 * 1024;
+    // Сколько закрытых сессий каждый поток держит для повторного использования
+    std::size_t session_pool_per_thread = 256;
+    std::size_t session_buffer_keep_bytes = 64 * 1024;
+    int url_hash_migration_batch = 10000;
+    std::chrono::milliseconds write_batch_window{5};
+    std::size_t write_batch_max_jobs = 512;
+    PragmaProfile sqlite_pragmas;
+    // Число параметров в подготовленном запросе "WHERE short_code IN (...)"
+    int resolve_batch_chunk = 64;
+    std::size_t url_cache_capacity_bytes = 64 * 1024 * 1024;
+    std::size_t url_cache_shards = 16;
+    // Прогрев кэша в фоне при старте: сначала коды, сохранённые при прошлой
+    // остановке в cache_hot_set_path, затем ссылки по cache_warmup — всего не
+    // больше cache_warmup_urls и свободного места в кэше. До конца прогрева
+    // /health отвечает 503. Пустой cache_hot_set_path — набор не сохраняется.
+    CacheWarmup cache_warmup = CacheWarmup::Recent;
+    std::size_t cache_warmup_urls = 100000;
+    std::string cache_hot_set_path = "urls.hotset";
+    std::size_t short_code_filter_min_capacity = 1000000;
+    double short_code_filter_false_positive_rate = 0.01;
+    CodeGeneratorMode code_generator_mode = CodeGeneratorMode::Random;
+    StorageEngine storage_engine = StorageEngine::Sqlite;
+    std::string db_path = "urls.db";
+    std::string snapshot_path = "urls.snapshot";
+    // Узлы кластера в виде host:port, одинаковые на всех узлах; пустой
+    // список — один узел без шардирования. cluster_self — индекс этого узла.
+    // Индекс записан в выданных кодах: новые узлы добавляются только в конец.
+    std::vector<std::string> cluster_nodes;
+    std::size_t cluster_self = 0;
+    int cluster_virtual_nodes = 128;
+    unsigned cluster_forward_threads = 1;
+    std::size_t cluster_peer_max_idle = 64;
+    std::chrono::seconds cluster_forward_timeout{5};
+    // Первичный узел отдаёт журнал вставок на replication_port (0 — выключено).
+    // Узел с непустым replication_primary (host:port журнала) — read-only
+    // реплика, применяющая журнал к своему хранилищу.
+    unsigned short replication_port = 0;
+    // Адрес слушателя журнала, как listen_address; пусто — listen_address.
+    // Журнал отдаётся без аутентификации: его стоит держать на loopback или
+    // внутреннем интерфейсе.
+    std::string replication_address;
+    std::string replication_primary;
+    int replication_batch = 1000;
+    std::chrono::milliseconds replication_poll_interval{20};
+    std::chrono::seconds replication_heartbeat{2};
+    std::chrono::seconds replication_reconnect_delay{1};
+    // Учёт переходов по ссылкам в таблицу clicks (для хранилища SQLite)
+    bool click_tracking = true;
+    std::chrono::milliseconds click_drain_interval{10};
+    std::chrono::seconds click_flush_interval{1};
+    std::size_t click_max_pending_keys = 100000;
+    bool rate_limiting = true;
+    RateLimit shorten_rate_limit{20, 50};
+    RateLimit shorten_batch_rate_limit{2, 5};
+    RateLimit resolve_rate_limit{1000, 2000};
+    RateLimit resolve_batch_rate_limit{20, 40};
+    // Таблица корзин фиксированного размера: шарды × слоты, память не растёт
+    std::size_t rate_limit_shards = 16;
+    std::size_t rate_limit_slots_per_shard = 4096;
+    std::chrono::seconds retry_after{1};
+    // Сверх max_sessions соединение сразу получает 503 без создания сессии;
+    // сверх write_queue_max_pending сокращение отвечает 503, а не ждёт в очереди
+    std::size_t max_sessions = 10000;
+    std::size_t write_queue_max_pending = 10000;
+    // Ссылки со сроком: истёкшая отвечает 410 ещё link_expired_retention,
+    // затем чистильщик удаляет её строку — не больше link_sweep_batch строк
+    // за link_sweep_interval. 0 — чистильщик выключен.
+    std::chrono::milliseconds link_sweep_interval{1000};
+    std::size_t link_sweep_batch = 500;
+    std::chrono::seconds link_expired_retention{3600};
+
+    // Текущий снимок настроек; до Config::load — значения по умолчанию
+    static const Config& current();
+    // Читает файл, окружение и аргументы и публикует результат
+    static void load(int argc, char* argv[]);
+    // Перечитывает те же источники (SIGHUP). Применяются только ключи,
+    // помеченные в configOptions() как перезагружаемые, остальные
+    // требуют перезапуска и остаются прежними.
+    static void reload();
+
+    void validate() const;
+};
+
+void parseConfigValue(const std::string& text, std::string& value) {
+    value = text;
+}
+
+void parseConfigValue(const std::string& text, bool& value) {
+    if (text == "true" || text == "1" || text == "yes" || text == "on") {
+        value = true;
+    } else if (text == "false" || text == "0" || text == "no" || text == "off") {
+        value = false;
+    } else {
+        throw std::invalid_argument("expected a boolean");
+    }
+}
+
+template <typename T>
+std::enable_if_t<std::is_arithmetic_v<T>> parseConfigValue(const std::string& text, T& value) {
+    std::istringstream in(text);
+    T parsed{};
+    if ((std::is_unsigned_v<T> && text.find('-') != std::string::npos) || !(in >> parsed) || !(in >> std::ws).eof()) {
+        throw std::invalid_argument("expected a number");
+    }
+    value = parsed;
+}
+
+// Длительность задаётся целым числом в единицах поля: секундах или миллисекундах
+template <typename Rep, typename Period>
+void parseConfigValue(const std::string& text, std::chrono::duration<Rep, Period>& value) {
+    Rep count{};
+    parseConfigValue(text, count);
+    value = std::chrono::duration<Rep, Period>(count);
+}
+
+// "host1:port,host2:port"
+void parseConfigValue(const std::string& text, std::vector<std::string>& value) {
+    value.clear();
+    std::size_t begin = 0;
+    while (begin <= text.size()) {
+        const std::size_t end = std::min(text.find(',', begin), text.size());
+        if (end > begin) {
+            value.push_back(text.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+}
+
+// "<в секунду>/<ёмкость>", например "20/50"; "0" — без ограничения
+void parseConfigValue(const std::string& text, RateLimit& value) {
+    const std::size_t slash = text.find('/');
+    RateLimit parsed;
+    parseConfigValue(text.substr(0, slash), parsed.per_second);
+    parsed.burst = parsed.per_second;
+    if (slash != std::string::npos) {
+        parseConfigValue(text.substr(slash + 1), parsed.burst);
+    }
+    value = parsed;
+}
+
+void parseConfigValue(const std::string& text, CodeGeneratorMode& value) {
+    if (text == "random") {
+        value = CodeGeneratorMode::Random;
+    } else if (text == "sequence") {
+        value = CodeGeneratorMode::Sequence;
+    } else {
+        throw std::invalid_argument("expected random or sequence");
+    }
+}
+
+void parseConfigValue(const std::string& text, CacheWarmup& value) {
+    if (text == "off") {
+        value = CacheWarmup::Off;
+    } else if (text == "recent") {
+        value = CacheWarmup::Recent;
+    } else if (text == "clicks") {
+        value = CacheWarmup::Clicks;
+    } else {
+        throw std::invalid_argument("expected off, recent or clicks");
+    }
+}
+
+void parseConfigValue(const std::string& text, StorageEngine& value) {
+    if (text == "sqlite") {
+        value = StorageEngine::Sqlite;
+    } else if (text == "memory") {
+        value = StorageEngine::Memory;
+    } else if (text == "snapshot") {
+        value = StorageEngine::Snapshot;
+    } else {
+        throw std::invalid_argument("expected sqlite, memory or snapshot");
+    }
+}
+
+struct ConfigOption {
+    std::string name;
+    // Читается при каждом использовании и применяется без перезапуска
+    bool reloadable;
+    std::function<void(Config&, const std::string&)> parse;
+    std::function<bool(const Config&, const Config&)> same;
+    std::function<void(Config& target, const Config& source)> copy;
+};
+
+// field — обобщённая лямбда, возвращающая ссылку на поле константного
+// или изменяемого Config
+template <typename Field>
+ConfigOption configOption(std::string name, bool reloadable, Field field) {
+    return {std::move(name), reloadable,
+            [field](Config& config, const std::string& text) { parseConfigValue(text, field(config)); },
+            [field](const Config& a, const Config& b) { return field(a) == field(b); },
+            [field](Config& target, const Config& source) { field(target) = field(source); }};
+}
+
+const std::vector<ConfigOption>& configOptions() {
+    constexpr bool STARTUP = false;
+    constexpr bool RELOADABLE = true;
+    static const std::vector<ConfigOption> options = {
+        configOption("short_domain", STARTUP, [](auto& c) -> auto& { return c.short_domain; }),
+        configOption("short_code_length", STARTUP, [](auto& c) -> auto& { return c.short_code_length; }),
+        configOption("server_port", STARTUP, [](auto& c) -> auto& { return c.server_port; }),
+        configOption("listen_address", STARTUP, [](auto& c) -> auto& { return c.listen_address; }),
+        configOption("listen_backlog", STARTUP, [](auto& c) -> auto& { return c.listen_backlog; }),
+        configOption("acceptors", STARTUP, [](auto& c) -> auto& { return c.acceptors; }),
+        configOption("accept_batch", RELOADABLE, [](auto& c) -> auto& { return c.accept_batch; }),
+        configOption("tcp_nodelay", RELOADABLE, [](auto& c) -> auto& { return c.tcp_nodelay; }),
+        configOption("tcp_fastopen_queue", STARTUP, [](auto& c) -> auto& { return c.tcp_fastopen_queue; }),
+        configOption("binary_port", STARTUP, [](auto& c) -> auto& { return c.binary_port; }),
+        configOption("binary_max_inflight", RELOADABLE, [](auto& c) -> auto& { return c.binary_max_inflight; }),
+        configOption("binary_frame_limit", RELOADABLE, [](auto& c) -> auto& { return c.binary_frame_limit; }),
+        configOption("worker_threads", STARTUP, [](auto& c) -> auto& { return c.worker_threads; }),
+        configOption("db_read_threads", STARTUP, [](auto& c) -> auto& { return c.db_read_threads; }),
+        configOption("redirect_status", RELOADABLE, [](auto& c) -> auto& { return c.redirect_status; }),
+        configOption("redirect_cache_control", RELOADABLE, [](auto& c) -> auto& { return c.redirect_cache_control; }),
+        configOption("session_idle_timeout", RELOADABLE, [](auto& c) -> auto& { return c.session_idle_timeout; }),
+        configOption("session_header_timeout", RELOADABLE, [](auto& c) -> auto& { return c.session_header_timeout; }),
+        configOption("session_body_timeout", RELOADABLE, [](auto& c) -> auto& { return c.session_body_timeout; }),
+        configOption("session_write_timeout", RELOADABLE, [](auto& c) -> auto& { return c.session_write_timeout; }),
+        configOption("session_header_limit", RELOADABLE, [](auto& c) -> auto& { return c.session_header_limit; }),
+        configOption("session_body_limit", RELOADABLE, [](auto& c) -> auto& { return c.session_body_limit; }),
+        configOption("session_pool_per_thread", RELOADABLE, [](auto& c) -> auto& { return c.session_pool_per_thread; }),
+        configOption("session_buffer_keep_bytes", RELOADABLE, [](auto& c) -> auto& { return c.session_buffer_keep_bytes; }),
+        configOption("url_hash_migration_batch", STARTUP, [](auto& c) -> auto& { return c.url_hash_migration_batch; }),
+        configOption("write_batch_window", STARTUP, [](auto& c) -> auto& { return c.write_batch_window; }),
+        configOption("write_batch_max_jobs", STARTUP, [](auto& c) -> auto& { return c.write_batch_max_jobs; }),
+        configOption("sqlite_journal_mode", STARTUP, [](auto& c) -> auto& { return c.sqlite_pragmas.journal_mode; }),
+        configOption("sqlite_synchronous", STARTUP, [](auto& c) -> auto& { return c.sqlite_pragmas.synchronous; }),
+        configOption("sqlite_mmap_size", STARTUP, [](auto& c) -> auto& { return c.sqlite_pragmas.mmap_size; }),
+        configOption("sqlite_cache_size", STARTUP, [](auto& c) -> auto& { return c.sqlite_pragmas.cache_size; }),
+        configOption("sqlite_temp_store", STARTUP, [](auto& c) -> auto& { return c.sqlite_pragmas.temp_store; }),
+        configOption("sqlite_busy_timeout_ms", STARTUP, [](auto& c) -> auto& { return c.sqlite_pragmas.busy_timeout_ms; }),
+        configOption("resolve_batch_chunk", STARTUP, [](auto& c) -> auto& { return c.resolve_batch_chunk; }),
+        configOption("url_cache_capacity_bytes", RELOADABLE, [](auto& c) -> auto& { return c.url_cache_capacity_bytes; }),
+        configOption("url_cache_shards", STARTUP, [](auto& c) -> auto& { return c.url_cache_shards; }),
+        configOption("cache_warmup", STARTUP, [](auto& c) -> auto& { return c.cache_warmup; }),
+        configOption("cache_warmup_urls", STARTUP, [](auto& c) -> auto& { return c.cache_warmup_urls; }),
+        configOption("cache_hot_set_path", STARTUP, [](auto& c) -> auto& { return c.cache_hot_set_path; }),
+        configOption("short_code_filter_min_capacity", STARTUP,
+                     [](auto& c) -> auto& { return c.short_code_filter_min_capacity; }),
+        configOption("short_code_filter_false_positive_rate", STARTUP,
+                     [](auto& c) -> auto& { return c.short_code_filter_false_positive_rate; }),
+        configOption("code_generator_mode", STARTUP, [](auto& c) -> auto& { return c.code_generator_mode; }),
+        configOption("storage_engine", STARTUP, [](auto& c) -> auto& { return c.storage_engine; }),
+        configOption("db_path", STARTUP, [](auto& c) -> auto& { return c.db_path; }),
+        configOption("snapshot_path", STARTUP, [](auto& c) -> auto& { return c.snapshot_path; }),
+        configOption("cluster_nodes", STARTUP, [](auto& c) -> auto& { return c.cluster_nodes; }),
+        configOption("cluster_self", STARTUP, [](auto& c) -> auto& { return c.cluster_self; }),
+        configOption("cluster_virtual_nodes", STARTUP, [](auto& c) -> auto& { return c.cluster_virtual_nodes; }),
+        configOption("cluster_forward_threads", STARTUP, [](auto& c) -> auto& { return c.cluster_forward_threads; }),
+        configOption("cluster_peer_max_idle", RELOADABLE, [](auto& c) -> auto& { return c.cluster_peer_max_idle; }),
+        configOption("cluster_forward_timeout", RELOADABLE, [](auto& c) -> auto& { return c.cluster_forward_timeout; }),
+        configOption("replication_port", STARTUP, [](auto& c) -> auto& { return c.replication_port; }),
+        configOption("replication_address", STARTUP, [](auto& c) -> auto& { return c.replication_address; }),
+        configOption("replication_primary", STARTUP, [](auto& c) -> auto& { return c.replication_primary; }),
+        configOption("replication_batch", RELOADABLE, [](auto& c) -> auto& { return c.replication_batch; }),
+        configOption("replication_poll_interval", RELOADABLE,
+                     [](auto& c) -> auto& { return c.replication_poll_interval; }),
+        configOption("replication_heartbeat", STARTUP, [](auto& c) -> auto& { return c.replication_heartbeat; }),
+        configOption("replication_reconnect_delay", RELOADABLE,
+                     [](auto& c) -> auto& { return c.replication_reconnect_delay; }),
+        configOption("click_tracking", STARTUP, [](auto& c) -> auto& { return c.click_tracking; }),
+        configOption("click_drain_interval", RELOADABLE, [](auto& c) -> auto& { return c.click_drain_interval; }),
+        configOption("click_flush_interval", RELOADABLE, [](auto& c) -> auto& { return c.click_flush_interval; }),
+        configOption("click_max_pending_keys", RELOADABLE, [](auto& c) -> auto& { return c.click_max_pending_keys; }),
+        configOption("rate_limiting", STARTUP, [](auto& c) -> auto& { return c.rate_limiting; }),
+        configOption("shorten_rate_limit", RELOADABLE, [](auto& c) -> auto& { return c.shorten_rate_limit; }),
+        configOption("shorten_batch_rate_limit", RELOADABLE, [](auto& c) -> auto& { return c.shorten_batch_rate_limit; }),
+        configOption("resolve_rate_limit", RELOADABLE, [](auto& c) -> auto& { return c.resolve_rate_limit; }),
+        configOption("resolve_batch_rate_limit", RELOADABLE, [](auto& c) -> auto& { return c.resolve_batch_rate_limit; }),
+        configOption("rate_limit_shards", STARTUP, [](auto& c) -> auto& { return c.rate_limit_shards; }),
+        configOption("rate_limit_slots_per_shard", STARTUP, [](auto& c) -> auto& { return c.rate_limit_slots_per_shard; }),
+        configOption("retry_after", RELOADABLE, [](auto& c) -> auto& { return c.retry_after; }),
+        configOption("max_sessions", RELOADABLE, [](auto& c) -> auto& { return c.max_sessions; }),
+        configOption("write_queue_max_pending", RELOADABLE, [](auto& c) -> auto& { return c.write_queue_max_pending; }),
+        configOption("link_sweep_interval", STARTUP, [](auto& c) -> auto& { return c.link_sweep_interval; }),
+        configOption("link_sweep_batch", RELOADABLE, [](auto& c) -> auto& { return c.link_sweep_batch; }),
+        configOption("link_expired_retention", RELOADABLE, [](auto& c) -> auto& { return c.link_expired_retention; }),
+    };
+    return options;
+}
+
+void Config::validate() const {
+    if (short_code_length < 1 || short_code_length > MAX_SHORT_CODE_LENGTH) {
+        throw std::invalid_argument("Config: short_code_length must be between 1 and "
+                                    + std::to_string(MAX_SHORT_CODE_LENGTH));
+    }
+    if (redirect_status != 0 && redirect_status != 301 && redirect_status != 302
+            && redirect_status != 307 && redirect_status != 308) {
+        throw std::invalid_argument("Config: redirect_status must be 0, 301, 302, 307 or 308");
+    }
+    if (!cluster_nodes.empty() && cluster_self >= cluster_nodes.size()) {
+        throw std::invalid_argument("Config: cluster_self is out of range of cluster_nodes");
+    }
+    // Первый символ кода занят номером узла
+    if (cluster_nodes.size() > CODE_ALPHABET.size() || (!cluster_nodes.empty() && short_code_length < 2)) {
+        throw std::invalid_argument("Config: a cluster needs at most " + std::to_string(CODE_ALPHABET.size())
+                                    + " nodes and short_code_length of at least 2");
+    }
+    if (resolve_batch_chunk < 1 || replication_batch < 1 || url_cache_shards == 0
+            || rate_limit_shards == 0 || rate_limit_slots_per_shard < RATE_LIMIT_PROBE) {
+        throw std::invalid_argument("Config: batch sizes and table sizes must be positive");
+    }
+    beast::error_code ec;
+    net::ip::make_address(listen_address, ec);
+    if (ec) {
+        throw std::invalid_argument("Config: listen_address is not an IP address");
+    }
+    if (!replication_address.empty()) {
+        net::ip::make_address(replication_address, ec);
+        if (ec) {
+            throw std::invalid_argument("Config: replication_address is not an IP address");
+        }
+    }
+    if (listen_backlog < 1 || accept_batch < 1 || tcp_fastopen_queue < 0) {
+        throw std::invalid_argument("Config: listen_backlog and accept_batch must be positive");
+    }
+    if (binary_port != 0 && binary_port == server_port) {
+        throw std::invalid_argument("Config: binary_port must differ from server_port");
+    }
+    if (binary_max_inflight < 1 || binary_frame_limit < BINARY_HEADER_SIZE) {
+        throw std::invalid_argument("Config: binary_max_inflight and binary_frame_limit are too small");
+    }
+    if (link_sweep_batch < 1 || link_expired_retention.count() < 0) {
+        throw std::invalid_argument("Config: link_sweep_batch must be positive and link_expired_retention not negative");
+    }
+}
+
+// Опубликованные снимки не освобождаются до выхода: перезагрузки редки, зато
+// ссылка из Config::current() остаётся действительной без счётчиков ссылок
+class ConfigStore {
+public:
+    static ConfigStore& instance() {
+        static ConfigStore store;
+        return store;
+    }
+
+    const Config& current() const {
+        return *current_.load(std::memory_order_acquire);
+    }
+
+    void publish(Config config) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        snapshots_.push_back(std::make_unique<const Config>(std::move(config)));
+        current_.store(snapshots_.back().get(), std::memory_order_release);
+    }
+
+    void load(int argc, char* argv[]) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            arguments_.assign(argv + std::min(argc, 1), argv + argc);
+        }
+        publish(read());
+    }
+
+    void reload() {
+        Config config = read();
+        const Config& previous = current();
+        for (const auto& option : configOptions()) {
+            if (!option.reloadable && !option.same(config, previous)) {
+                std::cerr << "Config: " << option.name << " requires a restart, change ignored" << std::endl;
+            }
+        }
+        // Неперезагружаемые ключи берутся из действующего снимка
+        Config merged = previous;
+        for (const auto& option : configOptions()) {
+            if (option.reloadable) {
+                option.copy(merged, config);
+            }
+        }
+        merged.validate();
+        publish(std::move(merged));
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<const Config>> snapshots_;
+    std::atomic<const Config*> current_;
+    std::vector<std::string> arguments_;
+
+    ConfigStore() {
+        snapshots_.push_back(std::make_unique<const Config>());
+        current_.store(snapshots_.back().get(), std::memory_order_release);
+    }
+
+    Config read() {
+        std::vector<std::string> arguments;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            arguments = arguments_;
+        }
+
+        std::map<std::string, std::string> values;
+        std::string config_path;
+        if (const char* path = std::getenv("URL_SHORTENER_CONFIG")) {
+            config_path = path;
+        }
+        std::map<std::string, std::string> command_line;
+        for (const auto& argument : arguments) {
+            if (argument.rfind("--", 0) != 0) {
+                continue;
+            }
+            const std::size_t equals = argument.find('=');
+            if (equals == std::string::npos) {
+                throw std::invalid_argument("Config: expected --<key>=<value>, got " + argument);
+            }
+            std::string key = argument.substr(2, equals - 2);
+            std::replace(key.begin(), key.end(), '-', '_');
+            if (key == "config") {
+                config_path = argument.substr(equals + 1);
+            } else {
+                command_line[key] = argument.substr(equals + 1);
+            }
+        }
+
+        if (!config_path.empty()) {
+            readFile(config_path, values);
+        }
+        for (const auto& option : configOptions()) {
+            std::string variable = "URL_SHORTENER_" + option.name;
+            std::transform(variable.begin(), variable.end(), variable.begin(),
+                           [](unsigned char c) { return static_cast<char>(std::toupper(c)); });
+            if (const char* value = std::getenv(variable.c_str())) {
+                values[option.name] = value;
+            }
+        }
+        for (auto& [key, value] : command_line) {
+            values[key] = std::move(value);
+        }
+
+        Config config;
+        for (const auto& [key, value] : values) {
+            const auto& options = configOptions();
+            const auto option = std::find_if(options.begin(), options.end(),
+                                             [&key = key](const ConfigOption& o) { return o.name == key; });
+            if (option == options.end()) {
+                throw std::invalid_argument("Config: unknown key " + key);
+            }
+            try {
+                option->parse(config, value);
+            } catch (const std::invalid_argument& e) {
+                throw std::invalid_argument("Config: bad value for " + key + " (" + e.what() + "): " + value);
+            }
+        }
+        config.validate();
+        return config;
+    }
+
+    // Строки "ключ = значение"; пустые строки и строки с # пропускаются
+    static void readFile(const std::string& path, std::map<std::string, std::string>& values) {
+        std::ifstream in(path);
+        if (!in) {
+            throw std::runtime_error("Config: cannot open " + path);
+        }
+        std::string line;
+        while (std::getline(in, line)) {
+            const auto trim = [](std::string text) {
+                const std::size_t first = text.find_first_not_of(" \t\r");
+                if (first == std::string::npos) {
+                    return std::string();
+                }
+                return text.substr(first, text.find_last_not_of(" \t\r") + 1 - first);
+            };
+            line = trim(line);
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            const std::size_t equals = line.find('=');
+            if (equals == std::string::npos) {
+                throw std::invalid_argument("Config: expected key = value in " + path + ": " + line);
+            }
+            values[trim(line.substr(0, equals))] = trim(line.substr(equals + 1));
+        }
+    }
+};
+
+const Config& Config::current() {
+    return ConfigStore::instance().current();
+}
+
+void Config::load(int argc, char* argv[]) {
+    ConfigStore::instance().load(argc, argv);
+}
+
+void Config::reload() {
+    ConfigStore::instance().reload();
+}
 
 const std::string RUNNING_MESSAGE = "URL Shortener Service is running!\n\n"
                                "Usage:\n"
                                "  POST/GET /makeshort/<url>  - Shorten a URL\n"
-                               "  GET /<code> - Decode a short URL";
+                               "  POST /makeshort/batch - Shorten newline-separated or JSON array of URLs\n"
+                               "  GET /<code> - Decode a short URL\n"
+                               "  POST /resolve/batch - Decode newline-separated or JSON array of codes\n"
+                               "  GET /metrics - Prometheus metrics";
+
+// Финализатор splitmix64: хорошо перемешивает биты 64-битного значения
+std::uint64_t mix64(std::uint64_t h) {
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+std::uint64_t fnv1a64(std::string_view data) {
+    std::uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : data) {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Стабильный между запусками хеш URL для столбца url_hash
+std::int64_t urlHash(std::string_view original_url) {
+    return static_cast<std::int64_t>(mix64(fnv1a64(original_url)));
+}
+
+class CodeGenerator {
+public:
+    static std::string generate(int length = Config::current().short_code_length) {
+        thread_local std::random_device rd;
+        thread_local std::mt19937 gen(rd());
+        thread_local std::uniform_int_distribution<> dist(0, CODE_ALPHABET.size() - 1);
+
+        std::string code;
+        code.reserve(length);
+        for (int i = 0; i < length; ++i) {
+            code += CODE_ALPHABET[dist(gen)];
+        }
+        return code;
+    }
+};
+
+// Кодирует последовательный id в base62-строку фиксированной длины.
+// Перед кодированием id биективно перемешивается сетью Фейстеля на ключе,
+// хранящемся в базе, поэтому соседние id дают непохожие коды, а разные id —
+// всегда разные коды.
+class SequenceCodeGenerator {
+public:
+    explicit SequenceCodeGenerator(std::uint64_t key, int length = Config::current().short_code_length)
+        : length_(length) {
+        for (int i = 0; i < length_; ++i) {
+            domain_ *= CODE_ALPHABET.size();
+        }
+        while ((std::uint64_t{1} << (2 * half_bits_)) < domain_) {
+            ++half_bits_;
+        }
+        for (auto& round_key : round_keys_) {
+            key = mix64(key + 0x9e3779b97f4a7c15ull);
+            round_key = key;
+        }
+    }
+
+    std::uint64_t capacity() const { return domain_; }
+
+    std::string generate(std::uint64_t id) const {
+        std::uint64_t value = permute(id % domain_);
+        std::string code(length_, CODE_ALPHABET[0]);
+        for (int i = length_ - 1; i >= 0; --i) {
+            code[i] = CODE_ALPHABET[value % CODE_ALPHABET.size()];
+            value /= CODE_ALPHABET.size();
+        }
+        return code;
+    }
+
+private:
+    int length_;
+    std::uint64_t domain_ = 1;
+    int half_bits_ = 1;
+    std::array<std::uint64_t, 6> round_keys_{};
+
+    // Сеть Фейстеля — перестановка на [0, 2^(2 * half_bits_)); повтор до
+    // попадания в [0, domain_) сужает её до перестановки на домене кодов.
+    std::uint64_t permute(std::uint64_t value) const {
+        const std::uint64_t mask = (std::uint64_t{1} << half_bits_) - 1;
+        do {
+            std::uint64_t left = value >> half_bits_;
+            std::uint64_t right = value & mask;
+            for (std::uint64_t round_key : round_keys_) {
+                const std::uint64_t next = left ^ (mix64(right ^ round_key) & mask);
+                left = right;
+                right = next;
+            }
+            value = (left << half_bits_) | right;
+        } while (value >= domain_);
+        return value;
+    }
+};
+
+void applyConnectionPragmas(SQLite::Database& db, const PragmaProfile& profile) {
+    db.setBusyTimeout(profile.busy_timeout_ms);
+    db.exec("PRAGMA synchronous = " + profile.synchronous);
+    db.exec("PRAGMA mmap_size = " + std::to_string(profile.mmap_size));
+    db.exec("PRAGMA cache_size = " + std::to_string(profile.cache_size));
+    db.exec("PRAGMA temp_store = " + profile.temp_store);
+}
+
+enum class Route {
+    Shorten,
+    ShortenBatch,
+    Resolve,
+    ResolveBatch,
+    Health,
+    Metrics,
+    BadRequest
+};
+
+constexpr std::size_t ROUTE_COUNT = static_cast<std::size_t>(Route::BadRequest) + 1;
+
+const char* routeName(Route route) {
+    switch (route) {
+    case Route::Shorten: return "shorten";
+    case Route::ShortenBatch: return "shorten_batch";
+    case Route::Resolve: return "resolve";
+    case Route::ResolveBatch: return "resolve_batch";
+    case Route::Health: return "health";
+    case Route::Metrics: return "metrics";
+    case Route::BadRequest: return "bad_request";
+    }
+    return "unknown";
+}
+
+RateLimit rateLimitFor(Route route) {
+    switch (route) {
+    case Route::Shorten: return Config::current().shorten_rate_limit;
+    case Route::ShortenBatch: return Config::current().shorten_batch_rate_limit;
+    case Route::Resolve: return Config::current().resolve_rate_limit;
+    case Route::ResolveBatch: return Config::current().resolve_batch_rate_limit;
+    case Route::Health:
+    case Route::Metrics:
+    case Route::BadRequest:
+        break;
+    }
+    return {};
+}
+
+// Причины, по которым сессию закрыли сроки и лимиты размера запроса
+enum class SessionLimit {
+    IdleTimeout,
+    HeaderTimeout,
+    BodyTimeout,
+    WriteTimeout,
+    HeaderTooLarge,
+    BodyTooLarge
+};
+
+constexpr std::size_t SESSION_LIMIT_COUNT = static_cast<std::size_t>(SessionLimit::BodyTooLarge) + 1;
+
+const char* sessionLimitName(SessionLimit limit) {
+    switch (limit) {
+    case SessionLimit::IdleTimeout: return "idle_timeout";
+    case SessionLimit::HeaderTimeout: return "header_timeout";
+    case SessionLimit::BodyTimeout: return "body_timeout";
+    case SessionLimit::WriteTimeout: return "write_timeout";
+    case SessionLimit::HeaderTooLarge: return "header_too_large";
+    case SessionLimit::BodyTooLarge: return "body_too_large";
+    }
+    return "unknown";
+}
+
+// Счётчики для /metrics. Каждый поток пишет только в собственный слот
+// (обычные load/store без RMW и без разделяемых кэш-линий); при выдаче
+// метрик слоты всех потоков суммируются.
+class Metrics {
+public:
+    enum class Query {
+        Read,
+        Write
+    };
+
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    void observeRequest(Route route, std::chrono::steady_clock::duration elapsed) {
+        local().routes[static_cast<std::size_t>(route)].observe(elapsed);
+    }
+
+    void observeQuery(Query query, std::chrono::steady_clock::duration elapsed) {
+        local().queries[static_cast<std::size_t>(query)].observe(elapsed);
+    }
+
+    void cacheHit() { increment(local().cache_hits); }
+    void cacheMiss() { increment(local().cache_misses); }
+    void filterRejection() { increment(local().filter_rejections); }
+    void sessionOpened() { add(local().active_sessions, 1); }
+    void sessionClosed() { add(local().active_sessions, -1); }
+    void clickRecorded() { increment(local().clicks_recorded); }
+    void clickDropped() { increment(local().clicks_dropped); }
+    void rateLimited() { increment(local().rate_limited); }
+    void connectionRejected() { increment(local().connections_rejected); }
+    void writeRejected() { increment(local().writes_rejected); }
+    void linksSwept(std::uint64_t count) { add(local().links_swept, count); }
+    void sessionTerminated(SessionLimit limit) {
+        increment(local().sessions_terminated[static_cast<std::size_t>(limit)]);
+    }
+
+    std::uint64_t cacheHits() const { return sum(&Slot::cache_hits); }
+    std::uint64_t cacheMisses() const { return sum(&Slot::cache_misses); }
+
+    std::string render() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string out;
+
+        out += "# HELP url_shortener_request_duration_seconds Request latency by route.\n"
+               "# TYPE url_shortener_request_duration_seconds histogram\n";
+        for (std::size_t route = 0; route < ROUTE_COUNT; ++route) {
+            renderHistogram(out, "url_shortener_request_duration_seconds",
+                            std::string("route=\"") + routeName(static_cast<Route>(route)) + "\"",
+                            [route](const Slot& slot) -> const Histogram& { return slot.routes[route]; });
+        }
+
+        out += "# HELP url_shortener_sqlite_query_duration_seconds SQLite read query and write transaction latency.\n"
+               "# TYPE url_shortener_sqlite_query_duration_seconds histogram\n";
+        renderHistogram(out, "url_shortener_sqlite_query_duration_seconds", "kind=\"read\"",
+                        [](const Slot& slot) -> const Histogram& { return slot.queries[0]; });
+        renderHistogram(out, "url_shortener_sqlite_query_duration_seconds", "kind=\"write\"",
+                        [](const Slot& slot) -> const Histogram& { return slot.queries[1]; });
+
+        const std::uint64_t hits = sumLocked(&Slot::cache_hits);
+        const std::uint64_t misses = sumLocked(&Slot::cache_misses);
+        out += "# TYPE url_shortener_cache_hits_total counter\n"
+               "url_shortener_cache_hits_total " + std::to_string(hits) + "\n"
+               "# TYPE url_shortener_cache_misses_total counter\n"
+               "url_shortener_cache_misses_total " + std::to_string(misses) + "\n"
+               "# TYPE url_shortener_cache_hit_ratio gauge\n"
+               "url_shortener_cache_hit_ratio "
+               + formatDouble(hits + misses == 0 ? 0.0 : static_cast<double>(hits) / (hits + misses)) + "\n";
+        out += "# TYPE url_shortener_filter_rejections_total counter\n"
+               "url_shortener_filter_rejections_total "
+               + std::to_string(sumLocked(&Slot::filter_rejections)) + "\n";
+        out += "# TYPE url_shortener_clicks_recorded_total counter\n"
+               "url_shortener_clicks_recorded_total " + std::to_string(sumLocked(&Slot::clicks_recorded)) + "\n"
+               "# TYPE url_shortener_clicks_dropped_total counter\n"
+               "url_shortener_clicks_dropped_total " + std::to_string(sumLocked(&Slot::clicks_dropped)) + "\n";
+        out += "# TYPE url_shortener_rate_limited_total counter\n"
+               "url_shortener_rate_limited_total " + std::to_string(sumLocked(&Slot::rate_limited)) + "\n"
+               "# TYPE url_shortener_connections_rejected_total counter\n"
+               "url_shortener_connections_rejected_total "
+               + std::to_string(sumLocked(&Slot::connections_rejected)) + "\n"
+               "# TYPE url_shortener_writes_rejected_total counter\n"
+               "url_shortener_writes_rejected_total " + std::to_string(sumLocked(&Slot::writes_rejected)) + "\n"
+               "# TYPE url_shortener_links_swept_total counter\n"
+               "url_shortener_links_swept_total " + std::to_string(sumLocked(&Slot::links_swept)) + "\n";
+
+        out += "# HELP url_shortener_sessions_terminated_total Sessions closed by request deadlines and size limits.\n"
+               "# TYPE url_shortener_sessions_terminated_total counter\n";
+        for (std::size_t limit = 0; limit < SESSION_LIMIT_COUNT; ++limit) {
+            std::uint64_t terminated = 0;
+            for (const auto& slot : slots_) {
+                terminated += slot->sessions_terminated[limit].load(std::memory_order_relaxed);
+            }
+            out += std::string("url_shortener_sessions_terminated_total{reason=\"")
+                   + sessionLimitName(static_cast<SessionLimit>(limit)) + "\"} " + std::to_string(terminated) + "\n";
+        }
+
+        std::int64_t sessions = 0;
+        for (const auto& slot : slots_) {
+            sessions += slot->active_sessions.load(std::memory_order_relaxed);
+        }
+        out += "# TYPE url_shortener_active_sessions gauge\n"
+               "url_shortener_active_sessions " + std::to_string(sessions) + "\n";
+        return out;
+    }
+
+private:
+    // Верхние границы корзин гистограммы
+    static constexpr std::array<std::chrono::nanoseconds::rep, 14> BUCKETS_NS = {
+        50'000, 100'000, 250'000, 500'000, 1'000'000, 2'500'000, 5'000'000,
+        10'000'000, 25'000'000, 50'000'000, 100'000'000, 250'000'000, 500'000'000, 1'000'000'000};
+
+    struct Histogram {
+        std::array<std::atomic<std::uint64_t>, BUCKETS_NS.size() + 1> buckets{};
+        std::atomic<std::uint64_t> sum_ns{0};
+
+        void observe(std::chrono::steady_clock::duration elapsed) {
+            const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+            std::size_t bucket = 0;
+            while (bucket < BUCKETS_NS.size() && ns > BUCKETS_NS[bucket]) {
+                ++bucket;
+            }
+            increment(buckets[bucket]);
+            add(sum_ns, static_cast<std::uint64_t>(std::max<std::chrono::nanoseconds::rep>(0, ns)));
+        }
+    };
+
+    struct alignas(64) Slot {
+        std::array<Histogram, ROUTE_COUNT> routes;
+        std::array<Histogram, 2> queries;
+        std::atomic<std::uint64_t> cache_hits{0};
+        std::atomic<std::uint64_t> cache_misses{0};
+        std::atomic<std::uint64_t> filter_rejections{0};
+        std::atomic<std::int64_t> active_sessions{0};
+        std::atomic<std::uint64_t> clicks_recorded{0};
+        std::atomic<std::uint64_t> clicks_dropped{0};
+        std::atomic<std::uint64_t> rate_limited{0};
+        std::atomic<std::uint64_t> connections_rejected{0};
+        std::atomic<std::uint64_t> writes_rejected{0};
+        std::atomic<std::uint64_t> links_swept{0};
+        std::array<std::atomic<std::uint64_t>, SESSION_LIMIT_COUNT> sessions_terminated{};
+    };
+
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<Slot>> slots_;
+
+    Metrics() = default;
+
+    Slot& local() {
+        thread_local Slot* slot = nullptr;
+        if (!slot) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            slots_.push_back(std::make_unique<Slot>());
+            slot = slots_.back().get();
+        }
+        return *slot;
+    }
+
+    // Единственный писатель у слота — его поток, поэтому RMW не нужен
+    template <typename T, typename V>
+    static void add(std::atomic<T>& counter, V value) {
+        counter.store(counter.load(std::memory_order_relaxed) + static_cast<T>(value), std::memory_order_relaxed);
+    }
+
+    template <typename T>
+    static void increment(std::atomic<T>& counter) {
+        add(counter, 1);
+    }
+
+    std::uint64_t sum(std::atomic<std::uint64_t> Slot::*counter) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return sumLocked(counter);
+    }
+
+    std::uint64_t sumLocked(std::atomic<std::uint64_t> Slot::*counter) const {
+        std::uint64_t total = 0;
+        for (const auto& slot : slots_) {
+            total += ((*slot).*counter).load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    template <typename Select>
+    void renderHistogram(std::string& out, const std::string& name, const std::string& labels,
+                         Select select) const {
+        std::array<std::uint64_t, BUCKETS_NS.size() + 1> buckets{};
+        std::uint64_t sum_ns = 0;
+        for (const auto& slot : slots_) {
+            const Histogram& histogram = select(*slot);
+            for (std::size_t i = 0; i < buckets.size(); ++i) {
+                buckets[i] += histogram.buckets[i].load(std::memory_order_relaxed);
+            }
+            sum_ns += histogram.sum_ns.load(std::memory_order_relaxed);
+        }
+
+        std::uint64_t cumulative = 0;
+        for (std::size_t i = 0; i < buckets.size(); ++i) {
+            cumulative += buckets[i];
+            const std::string le = i < BUCKETS_NS.size() ? formatDouble(BUCKETS_NS[i] / 1e9) : "+Inf";
+            out += name + "_bucket{" + labels + ",le=\"" + le + "\"} " + std::to_string(cumulative) + "\n";
+        }
+        out += name + "_sum{" + labels + "} " + formatDouble(sum_ns / 1e9) + "\n";
+        out += name + "_count{" + labels + "} " + std::to_string(cumulative) + "\n";
+    }
+
+    static std::string formatDouble(double value) {
+        std::ostringstream out;
+        out << value;
+        return out.str();
+    }
+};
+
+// Наибольший id, когда-либо выданный в urls: AUTOINCREMENT хранит его в
+// sqlite_sequence и после удаления строк, так что id не выдаются повторно
+const char* const LAST_URL_ID_SQL =
+    "SELECT MAX(COALESCE((SELECT seq FROM sqlite_sequence WHERE name = 'urls'), 0), COALESCE(MAX(id), 0)) "
+    "FROM urls";
+
+// Сбрасывает подготовленный запрос после использования, чтобы читатель
+// не удерживал открытую транзакцию чтения между запросами.
+class StatementReset {
+public:
+    explicit StatementReset(SQLite::Statement& statement) : statement_(statement) {}
+
+    ~StatementReset() {
+        try {
+            statement_.reset();
+        } catch (const SQLite::Exception&) {
+        }
+        statement_.clearBindings();
+    }
+
+private:
+    SQLite::Statement& statement_;
+};
+
+// Результат поиска кода. Expired — ссылка была, но её срок истёк (410).
+enum class Lookup {
+    Found,
+    Missing,
+    Expired,
+};
+
+std::int64_t unixNow() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// expires_at — unix-время в секундах, 0 — бессрочная ссылка
+bool linkExpired(std::int64_t expires_at) {
+    return expires_at != 0 && expires_at <= unixNow();
+}
+
+// Строка urls; в журнале репликации id — id строки первичного узла
+struct ReplicatedUrl {
+    std::int64_t id = 0;
+    std::string short_code;
+    std::string original_url;
+    std::int64_t expires_at = 0;
+};
+
+// Переходы по коду с одного referrer, накопленные агрегатором
+struct ClickCount {
+    std::string short_code;
+    std::string referrer;
+    std::uint64_t count = 0;
+};
+
+class ReadConnection {
+public:
+    explicit ReadConnection(const std::string& db_path)
+        : db_(db_path, SQLite::OPEN_READONLY, Config::current().sqlite_pragmas.busy_timeout_ms)
+        , select_original_url_(db_, "SELECT original_url, expires_at FROM urls WHERE short_code = ?")
+        , select_original_urls_(db_, selectOriginalUrlsSql())
+        , select_urls_since_(db_,
+            "SELECT id, short_code, original_url, expires_at FROM urls WHERE id > ? ORDER BY id LIMIT ?")
+        , select_recent_urls_(db_, R"(
+            SELECT id, short_code, original_url, expires_at FROM urls
+            WHERE expires_at IS NULL OR expires_at > ?2
+            ORDER BY id DESC LIMIT ?1
+        )")
+        , select_clicked_urls_(db_, R"(
+            SELECT urls.id, urls.short_code, urls.original_url, urls.expires_at
+            FROM (SELECT short_code, SUM(count) AS total FROM clicks
+                  GROUP BY short_code ORDER BY total DESC LIMIT ?1) AS hot
+            JOIN urls ON urls.short_code = hot.short_code
+            WHERE urls.expires_at IS NULL OR urls.expires_at > ?2
+            ORDER BY hot.total DESC
+        )")
+        , select_expired_urls_(db_,
+            "SELECT id, short_code FROM urls WHERE expires_at <= ? ORDER BY expires_at LIMIT ?") {
+        applyConnectionPragmas(db_, Config::current().sqlite_pragmas);
+    }
+
+    // expires_at у бессрочной ссылки (NULL в базе) — 0
+    bool getOriginalUrl(const std::string& short_code, std::string& original_url, std::int64_t& expires_at) {
+        StatementReset reset(select_original_url_);
+        select_original_url_.bind(1, short_code);
+        if (select_original_url_.executeStep()) {
+            original_url.assign(select_original_url_.getColumn(0).getText());
+            expires_at = select_original_url_.getColumn(1).getInt64();
+            return true;
+        }
+        return false;
+    }
+
+    // Ищет codes[indices[i]] порциями по resolve_batch_chunk и записывает
+    // найденные URL и их сроки в results и expires по тем же индексам
+    void getOriginalUrls(const std::vector<std::string>& codes, const std::vector<std::size_t>& indices,
+                         std::vector<std::string>& results, std::vector<std::int64_t>& expires) {
+        for (std::size_t begin = 0; begin < indices.size(); begin += Config::current().resolve_batch_chunk) {
+            const std::size_t end = std::min(indices.size(), begin + Config::current().resolve_batch_chunk);
+
+            StatementReset reset(select_original_urls_);
+            for (std::size_t i = begin; i < end; ++i) {
+                select_original_urls_.bind(static_cast<int>(i - begin + 1), codes[indices[i]]);
+            }
+            // Незанятые параметры остаются NULL и ничему не соответствуют
+            while (select_original_urls_.executeStep()) {
+                const std::string_view short_code = select_original_urls_.getColumn(0).getText();
+                for (std::size_t i = begin; i < end; ++i) {
+                    if (codes[indices[i]] == short_code) {
+                        results[indices[i]] = select_original_urls_.getColumn(1).getText();
+                        expires[indices[i]] = select_original_urls_.getColumn(2).getInt64();
+                    }
+                }
+            }
+        }
+    }
+
+    // Строки с id больше since по возрастанию id, не более limit
+    void urlsSince(std::int64_t since, int limit, std::vector<ReplicatedUrl>& rows) {
+        rows.clear();
+        StatementReset reset(select_urls_since_);
+        select_urls_since_.bind(1, since);
+        select_urls_since_.bind(2, limit);
+        while (select_urls_since_.executeStep()) {
+            rows.push_back(urlRow(select_urls_since_));
+        }
+    }
+
+    // Ссылки для прогрева кэша, самые нужные первыми, без истёкших. Порядок
+    // id совпадает с created_at, но идёт по первичному ключу без отдельного индекса.
+    void warmupUrls(CacheWarmup source, std::size_t limit, std::vector<ReplicatedUrl>& rows) {
+        rows.clear();
+        if (source == CacheWarmup::Off || limit == 0) {
+            return;
+        }
+        SQLite::Statement& query = source == CacheWarmup::Recent ? select_recent_urls_ : select_clicked_urls_;
+        StatementReset reset(query);
+        query.bind(1, static_cast<std::int64_t>(limit));
+        query.bind(2, unixNow());
+        while (query.executeStep()) {
+            rows.push_back(urlRow(query));
+        }
+    }
+
+    // id и коды ссылок, истёкших не позже cutoff, по частичному индексу
+    // idx_expires_at — самые старые первыми
+    void expiredUrls(std::int64_t cutoff, std::size_t limit, std::vector<ReplicatedUrl>& rows) {
+        rows.clear();
+        StatementReset reset(select_expired_urls_);
+        select_expired_urls_.bind(1, cutoff);
+        select_expired_urls_.bind(2, static_cast<std::int64_t>(limit));
+        while (select_expired_urls_.executeStep()) {
+            ReplicatedUrl row;
+            row.id = select_expired_urls_.getColumn(0).getInt64();
+            row.short_code = select_expired_urls_.getColumn(1).getText();
+            rows.push_back(std::move(row));
+        }
+    }
+
+    // Строки, удалённые чистильщиком, не уменьшают позицию: sqlite_sequence
+    // помнит наибольший выданный id
+    std::int64_t lastUrlId() {
+        SQLite::Statement query(db_, LAST_URL_ID_SQL);
+        query.executeStep();
+        return query.getColumn(0).getInt64();
+    }
+
+private:
+    SQLite::Database db_;
+    SQLite::Statement select_original_url_;
+    SQLite::Statement select_original_urls_;
+    SQLite::Statement select_urls_since_;
+    SQLite::Statement select_recent_urls_;
+    SQLite::Statement select_clicked_urls_;
+    SQLite::Statement select_expired_urls_;
+
+    static ReplicatedUrl urlRow(SQLite::Statement& query) {
+        ReplicatedUrl row;
+        row.id = query.getColumn(0).getInt64();
+        row.short_code = query.getColumn(1).getText();
+        row.original_url = query.getColumn(2).getText();
+        row.expires_at = query.getColumn(3).getInt64();
+        return row;
+    }
+
+    static std::string selectOriginalUrlsSql() {
+        std::string sql = "SELECT short_code, original_url, expires_at FROM urls WHERE short_code IN (?";
+        for (int i = 1; i < Config::current().resolve_batch_chunk; ++i) {
+            sql += ", ?";
+        }
+        return sql + ")";
+    }
+};
+
+// code_prefix — начало всех выдаваемых кодов: в кластере номер узла
+// (clusterCodePrefix), генератор дописывает к нему остаток длины.
+class WriteConnection {
+public:
+    explicit WriteConnection(const std::string& db_path, std::string code_prefix = {})
+        : db_(db_path, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE)
+        , code_prefix_(std::move(code_prefix)) {
+        initializeSchema();
+        // Ссылки со сроком не дедуплицируются: у одинаковых URL могут быть разные сроки
+        select_by_hash_ = std::make_unique<SQLite::Statement>(db_,
+            "SELECT short_code, original_url FROM urls WHERE url_hash = ? AND expires_at IS NULL");
+        insert_url_ = std::make_unique<SQLite::Statement>(db_,
+            "INSERT INTO urls (short_code, original_url, url_hash, expires_at) VALUES (?, ?, ?, ?)");
+        insert_url_with_id_ = std::make_unique<SQLite::Statement>(db_,
+            "INSERT OR IGNORE INTO urls (id, short_code, original_url, url_hash, expires_at) VALUES (?, ?, ?, ?, ?)");
+        delete_url_ = std::make_unique<SQLite::Statement>(db_, "DELETE FROM urls WHERE id = ?");
+        delete_clicks_ = std::make_unique<SQLite::Statement>(db_, "DELETE FROM clicks WHERE short_code = ?");
+        upsert_clicks_ = std::make_unique<SQLite::Statement>(db_,
+            "INSERT INTO clicks (short_code, referrer, count) VALUES (?, ?, ?) "
+            "ON CONFLICT (short_code, referrer) DO UPDATE SET "
+            "count = count + excluded.count, last_click_at = CURRENT_TIMESTAMP");
+        sequence_generator_ = std::make_unique<SequenceCodeGenerator>(
+            loadSequenceKey(), Config::current().short_code_length - static_cast<int>(code_prefix_.size()));
+        next_id_ = lastUrlId() + 1;
+    }
+
+    void initializeSchema() {
+        // journal_mode хранится в самом файле базы, остальное — в соединении
+        db_.exec("PRAGMA journal_mode = " + Config::current().sqlite_pragmas.journal_mode);
+        applyConnectionPragmas(db_, Config::current().sqlite_pragmas);
+
+        db_.exec(R"(
+            CREATE TABLE IF NOT EXISTS urls (
+                id INTEGER PRIMARY KEY AUTOINCREMENT,
+                short_code TEXT UNIQUE NOT NULL,
+                original_url TEXT NOT NULL,
+                created_at DATETIME DEFAULT CURRENT_TIMESTAMP,
+                url_hash INTEGER,
+                expires_at INTEGER
+            )
+        )");
+        migrateUrlHash();
+        if (!hasColumn("expires_at")) {
+            std::cout << "Migrating urls table: adding expires_at column..." << std::endl;
+            db_.exec("ALTER TABLE urls ADD COLUMN expires_at INTEGER");
+        }
+        db_.exec("CREATE INDEX IF NOT EXISTS idx_short_code ON urls(short_code)");
+        db_.exec("CREATE INDEX IF NOT EXISTS idx_url_hash ON urls(url_hash)");
+        // Чистильщику нужны только ссылки со сроком, а их обычно меньшинство
+        db_.exec("CREATE INDEX IF NOT EXISTS idx_expires_at ON urls(expires_at) WHERE expires_at IS NOT NULL");
+        db_.exec("DROP INDEX IF EXISTS idx_original_url");
+        db_.exec(R"(
+            CREATE TABLE IF NOT EXISTS settings (
+                name TEXT PRIMARY KEY,
+                value INTEGER NOT NULL
+            )
+        )");
+        db_.exec(R"(
+            CREATE TABLE IF NOT EXISTS clicks (
+                short_code TEXT NOT NULL,
+                referrer TEXT NOT NULL,
+                count INTEGER NOT NULL,
+                last_click_at DATETIME DEFAULT CURRENT_TIMESTAMP,
+                PRIMARY KEY (short_code, referrer)
+            ) WITHOUT ROWID
+        )");
+    }
+
+    std::size_t countUrls() {
+        SQLite::Statement query(db_, "SELECT COUNT(*) FROM urls");
+        query.executeStep();
+        return static_cast<std::size_t>(query.getColumn(0).getInt64());
+    }
+
+    template <typename Callback>
+    void forEachShortCode(Callback&& callback) {
+        SQLite::Statement query(db_, "SELECT short_code FROM urls");
+        while (query.executeStep()) {
+            callback(query.getColumn(0).getText());
+        }
+    }
+
+    // expires_at — unix-время в секундах, 0 — бессрочная ссылка
+    std::string shortenUrl(const std::string& original_url, std::int64_t expires_at = 0) {
+        const std::int64_t hash = urlHash(original_url);
+        if (expires_at == 0) {
+            // Полный URL сравнивается только у строк с совпавшим хешем
+            StatementReset reset(*select_by_hash_);
+            select_by_hash_->bind(1, hash);
+            while (select_by_hash_->executeStep()) {
+                if (original_url == select_by_hash_->getColumn(1).getText()) {
+                    return select_by_hash_->getColumn(0).getText();
+                }
+            }
+        }
+
+        if (Config::current().code_generator_mode == CodeGeneratorMode::Sequence) {
+            return insertWithSequenceCode(original_url, hash, expires_at);
+        }
+
+        std::string short_code;
+        int max_attempts = 10;
+        for (int i = 0; i < max_attempts; ++i) {
+            short_code = code_prefix_ + CodeGenerator::generate(
+                Config::current().short_code_length - static_cast<int>(code_prefix_.size()));
+            try {
+                StatementReset reset(*insert_url_);
+                insert_url_->bind(1, short_code);
+                insert_url_->bind(2, original_url);
+                insert_url_->bind(3, hash);
+                bindExpiresAt(*insert_url_, 4, expires_at);
+                insert_url_->exec();
+                return short_code;
+            } catch (const SQLite::Exception& e) {
+                if (i == max_attempts - 1) throw;
+            }
+        }
+        throw std::runtime_error("Failed to generate unique short code");
+    }
+
+    // Строка с id первичного узла; повторно присланная строка пропускается
+    void insertReplicated(const ReplicatedUrl& row) {
+        StatementReset reset(*insert_url_with_id_);
+        insert_url_with_id_->bind(1, row.id);
+        insert_url_with_id_->bind(2, row.short_code);
+        insert_url_with_id_->bind(3, row.original_url);
+        insert_url_with_id_->bind(4, urlHash(row.original_url));
+        bindExpiresAt(*insert_url_with_id_, 5, row.expires_at);
+        insert_url_with_id_->exec();
+        next_id_ = std::max(next_id_, row.id + 1);
+    }
+
+    // Удаляет строки по id вместе с их переходами; возвращает число удалённых
+    std::size_t deleteUrls(const std::vector<ReplicatedUrl>& rows) {
+        std::size_t deleted = 0;
+        for (const auto& row : rows) {
+            StatementReset reset(*delete_url_);
+            delete_url_->bind(1, row.id);
+            if (delete_url_->exec() == 0) {
+                continue;
+            }
+            ++deleted;
+            StatementReset reset_clicks(*delete_clicks_);
+            delete_clicks_->bind(1, row.short_code);
+            delete_clicks_->exec();
+        }
+        return deleted;
+    }
+
+    void addClicks(const ClickCount& clicks) {
+        StatementReset reset(*upsert_clicks_);
+        upsert_clicks_->bind(1, clicks.short_code);
+        upsert_clicks_->bind(2, clicks.referrer);
+        upsert_clicks_->bind(3, static_cast<std::int64_t>(clicks.count));
+        upsert_clicks_->exec();
+    }
+
+    SQLite::Database& database() { return db_; }
+
+private:
+    SQLite::Database db_;
+    const std::string code_prefix_;
+    // Запросы готовятся после создания схемы, поэтому хранятся через указатель
+    std::unique_ptr<SQLite::Statement> select_by_hash_;
+    std::unique_ptr<SQLite::Statement> insert_url_;
+    std::unique_ptr<SQLite::Statement> insert_url_with_id_;
+    std::unique_ptr<SQLite::Statement> delete_url_;
+    std::unique_ptr<SQLite::Statement> delete_clicks_;
+    std::unique_ptr<SQLite::Statement> upsert_clicks_;
+    std::unique_ptr<SequenceCodeGenerator> sequence_generator_;
+    // Пишет только поток WriteQueue, поэтому счётчик не требует синхронизации
+    std::int64_t next_id_ = 1;
+
+    // Базы, созданные до появления url_hash: добавляем столбец и заполняем
+    // его порциями, каждая в своей транзакции
+    void migrateUrlHash() {
+        if (!hasColumn("url_hash")) {
+            std::cout << "Migrating urls table: adding url_hash column..." << std::endl;
+            db_.exec("ALTER TABLE urls ADD COLUMN url_hash INTEGER");
+        }
+
+        SQLite::Statement select(db_,
+            "SELECT id, original_url FROM urls WHERE url_hash IS NULL LIMIT ?");
+        SQLite::Statement update(db_, "UPDATE urls SET url_hash = ? WHERE id = ?");
+        for (;;) {
+            std::vector<std::pair<std::int64_t, std::int64_t>> hashes;
+            {
+                StatementReset reset(select);
+                select.bind(1, Config::current().url_hash_migration_batch);
+                while (select.executeStep()) {
+                    hashes.emplace_back(select.getColumn(0).getInt64(),
+                                        urlHash(select.getColumn(1).getText()));
+                }
+            }
+            if (hashes.empty()) {
+                return;
+            }
+
+            SQLite::Transaction transaction(db_);
+            for (const auto& [id, hash] : hashes) {
+                StatementReset reset(update);
+                update.bind(1, hash);
+                update.bind(2, id);
+                update.exec();
+            }
+            transaction.commit();
+        }
+    }
+
+    bool hasColumn(std::string_view name) {
+        SQLite::Statement columns(db_, "PRAGMA table_info(urls)");
+        while (columns.executeStep()) {
+            if (std::string_view(columns.getColumn(1).getText()) == name) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void bindExpiresAt(SQLite::Statement& statement, int index, std::int64_t expires_at) {
+        if (expires_at != 0) {
+            statement.bind(index, expires_at);
+        } else {
+            statement.bind(index);
+        }
+    }
+
+    std::int64_t lastUrlId() {
+        SQLite::Statement query(db_, LAST_URL_ID_SQL);
+        query.executeStep();
+        return query.getColumn(0).getInt64();
+    }
+
+    // Ключ перестановки создаётся один раз: коды должны оставаться
+    // детерминированными от id и после перезапуска
+    std::uint64_t loadSequenceKey() {
+        SQLite::Statement select(db_, "SELECT value FROM settings WHERE name = 'code_sequence_key'");
+        if (select.executeStep()) {
+            return static_cast<std::uint64_t>(select.getColumn(0).getInt64());
+        }
+
+        std::random_device rd;
+        const std::uint64_t key = (std::uint64_t{rd()} << 32) ^ rd();
+        SQLite::Statement insert(db_, "INSERT INTO settings (name, value) VALUES ('code_sequence_key', ?)");
+        insert.bind(1, static_cast<std::int64_t>(key));
+        insert.exec();
+        return key;
+    }
+
+    // id уникален как первичный ключ, а код — биекция от id, поэтому вставка
+    // проходит с первой попытки. Следующий id берётся, только если код уже
+    // занят строкой, созданной ранее случайным генератором.
+    std::string insertWithSequenceCode(const std::string& original_url, std::int64_t hash, std::int64_t expires_at) {
+        for (;;) {
+            const std::int64_t id = next_id_++;
+            if (static_cast<std::uint64_t>(id) >= sequence_generator_->capacity()) {
+                throw std::runtime_error("Short code space is exhausted");
+            }
+
+            const std::string short_code = code_prefix_ + sequence_generator_->generate(static_cast<std::uint64_t>(id));
+            StatementReset reset(*insert_url_with_id_);
+            insert_url_with_id_->bind(1, static_cast<std::int64_t>(id));
+            insert_url_with_id_->bind(2, short_code);
+            insert_url_with_id_->bind(3, original_url);
+            insert_url_with_id_->bind(4, hash);
+            bindExpiresAt(*insert_url_with_id_, 5, expires_at);
+            if (insert_url_with_id_->exec() > 0) {
+                return short_code;
+            }
+        }
+    }
+};
+
+// Пул соединений для чтения: соединение берётся на время одного запроса и
+// возвращается обратно, так что их число не превышает число потоков чтения.
+class ReadConnectionPool {
+public:
+    class Lease {
+    public:
+        Lease(ReadConnectionPool& pool, std::unique_ptr<ReadConnection> connection)
+            : pool_(pool), connection_(std::move(connection)) {}
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        ~Lease() {
+            pool_.release(std::move(connection_));
+        }
+
+        ReadConnection* operator->() const { return connection_.get(); }
+
+    private:
+        ReadConnectionPool& pool_;
+        std::unique_ptr<ReadConnection> connection_;
+    };
+
+    explicit ReadConnectionPool(std::string db_path) : db_path_(std::move(db_path)) {}
+
+    Lease acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!idle_.empty()) {
+                auto connection = std::move(idle_.back());
+                idle_.pop_back();
+                return Lease(*this, std::move(connection));
+            }
+        }
+        return Lease(*this, std::make_unique<ReadConnection>(db_path_));
+    }
+
+private:
+    std::string db_path_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<ReadConnection>> idle_;
+
+    void release(std::unique_ptr<ReadConnection> connection) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        idle_.push_back(std::move(connection));
+    }
+};
+
+// Шардированный LRU-кэш short_code -> original_url с ограничением по байтам.
+// Каждый шард защищён своим мьютексом, поэтому потоки редко конкурируют.
+// Попадания и промахи считаются в Metrics. Запись истёкшей ссылки остаётся
+// в кэше и отвечает Expired, пока её не вытеснит LRU.
+class UrlCache {
+public:
+    // Ёмкость читается из Config при каждой вставке и меняется без перезапуска:
+    // после уменьшения лишнее вытесняется следующими вставками в шард
+    explicit UrlCache(std::size_t shard_count)
+        : shards_(std::max<std::size_t>(1, shard_count)) {}
+
+    // std::nullopt — промах
+    std::optional<Lookup> get(const std::string& short_code, std::string& original_url) {
+        Shard& shard = shardFor(short_code);
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.index.find(short_code);
+            if (it != shard.index.end()) {
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                Metrics::instance().cacheHit();
+                if (linkExpired(it->second->expires_at)) {
+                    return Lookup::Expired;
+                }
+                original_url = it->second->original_url;
+                return Lookup::Found;
+            }
+        }
+        Metrics::instance().cacheMiss();
+        return std::nullopt;
+    }
+
+    // Имеющаяся запись заменяется: код удалённой чистильщиком ссылки может
+    // быть выдан заново
+    void put(const std::string& short_code, const std::string& original_url, std::int64_t expires_at = 0) {
+        const std::size_t size = entrySize(short_code, original_url);
+        const std::size_t shard_capacity = Config::current().url_cache_capacity_bytes / shards_.size();
+        if (size > shard_capacity) {
+            return;
+        }
+
+        Shard& shard = shardFor(short_code);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(short_code);
+        if (it != shard.index.end()) {
+            Entry& entry = *it->second;
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            if (entry.original_url != original_url) {
+                shard.bytes = shard.bytes - entrySize(entry.short_code, entry.original_url) + size;
+                entry.original_url = original_url;
+            }
+            entry.expires_at = expires_at;
+            return;
+        }
+
+        while (shard.bytes + size > shard_capacity && !shard.lru.empty()) {
+            const Entry& victim = shard.lru.back();
+            shard.bytes -= entrySize(victim.short_code, victim.original_url);
+            shard.index.erase(victim.short_code);
+            shard.lru.pop_back();
+        }
+
+        shard.lru.push_front(Entry{short_code, original_url, expires_at});
+        shard.index.emplace(shard.lru.front().short_code, shard.lru.begin());
+        shard.bytes += size;
+    }
+
+    // Прогрев: запись встаёт в холодный конец LRU и только на свободное место,
+    // поэтому не вытесняет то, что уже положили живые запросы. Вызывается в
+    // порядке убывания важности. false — в шарде нет места.
+    bool preload(const std::string& short_code, const std::string& original_url, std::int64_t expires_at) {
+        const std::size_t size = entrySize(short_code, original_url);
+        const std::size_t shard_capacity = Config::current().url_cache_capacity_bytes / shards_.size();
+
+        Shard& shard = shardFor(short_code);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.bytes + size > shard_capacity) {
+            return false;
+        }
+        if (shard.index.find(short_code) == shard.index.end()) {
+            shard.lru.push_back(Entry{short_code, original_url, expires_at});
+            shard.index.emplace(shard.lru.back().short_code, std::prev(shard.lru.end()));
+            shard.bytes += size;
+        }
+        return true;
+    }
+
+    // Не больше limit кодов, самые свежие первыми: шарды обходятся по кругу,
+    // из каждого — по одному от головы его LRU. Истёкшие пропускаются.
+    std::vector<std::string> hotCodes(std::size_t limit) {
+        std::vector<std::vector<std::string>> per_shard(shards_.size());
+        const std::size_t shard_limit = limit / shards_.size() + 1;
+        const std::int64_t now = unixNow();
+        for (std::size_t i = 0; i < shards_.size(); ++i) {
+            std::lock_guard<std::mutex> lock(shards_[i].mutex);
+            for (const Entry& entry : shards_[i].lru) {
+                if (per_shard[i].size() == shard_limit) {
+                    break;
+                }
+                if (entry.expires_at != 0 && entry.expires_at <= now) {
+                    continue;
+                }
+                per_shard[i].push_back(entry.short_code);
+            }
+        }
+
+        std::vector<std::string> codes;
+        for (std::size_t rank = 0; rank < shard_limit && codes.size() < limit; ++rank) {
+            for (auto& shard_codes : per_shard) {
+                if (rank < shard_codes.size() && codes.size() < limit) {
+                    codes.push_back(std::move(shard_codes[rank]));
+                }
+            }
+        }
+        return codes;
+    }
+
+private:
+    struct Entry {
+        std::string short_code;
+        std::string original_url;
+        std::int64_t expires_at = 0;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> lru;
+        // Ключи ссылаются на строки внутри узлов списка
+        std::unordered_map<std::string_view, std::list<Entry>::iterator> index;
+        std::size_t bytes = 0;
+    };
+
+    std::vector<Shard> shards_;
+
+    static std::size_t entrySize(const std::string& short_code, const std::string& original_url) {
+        // Примерные накладные расходы узла списка и записи хеш-таблицы
+        return short_code.size() + original_url.size() + sizeof(Entry) + 64;
+    }
+
+    Shard& shardFor(std::string_view short_code) {
+        return shards_[std::hash<std::string_view>{}(short_code) % shards_.size()];
+    }
+};
+
+// Фильтр Блума по всем существующим short_code: если код точно не встречался,
+// запрос получает 404 без обращения к SQLite. Биты выставляются атомарно,
+// так что add() и mayContain() можно вызывать из любых потоков.
+class ShortCodeFilter {
+public:
+    ShortCodeFilter(std::size_t expected_codes, double false_positive_rate) {
+        const double n = static_cast<double>(std::max<std::size_t>(1, expected_codes));
+        const double ln2 = std::log(2.0);
+        const double bits = std::ceil(-n * std::log(false_positive_rate) / (ln2 * ln2));
+        words_ = std::max<std::size_t>(1, static_cast<std::size_t>(bits / 64) + 1);
+        bit_count_ = words_ * 64;
+        hash_count_ = std::max(1, static_cast<int>(std::round(bit_count_ / n * ln2)));
+        bits_ = std::make_unique<std::atomic<std::uint64_t>[]>(words_);
+    }
+
+    void add(std::string_view short_code) {
+        std::uint64_t h1, h2;
+        hashes(short_code, h1, h2);
+        for (int i = 0; i < hash_count_; ++i) {
+            const std::uint64_t bit = (h1 + i * h2) % bit_count_;
+            bits_[bit / 64].fetch_or(std::uint64_t{1} << (bit % 64), std::memory_order_relaxed);
+        }
+    }
+
+    bool mayContain(std::string_view short_code) const {
+        std::uint64_t h1, h2;
+        hashes(short_code, h1, h2);
+        for (int i = 0; i < hash_count_; ++i) {
+            const std::uint64_t bit = (h1 + i * h2) % bit_count_;
+            if (!(bits_[bit / 64].load(std::memory_order_relaxed) & (std::uint64_t{1} << (bit % 64)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    std::unique_ptr<std::atomic<std::uint64_t>[]> bits_;
+    std::size_t words_;
+    std::uint64_t bit_count_;
+    int hash_count_;
+
+    static void hashes(std::string_view short_code, std::uint64_t& h1, std::uint64_t& h2) {
+        // FNV-1a и перемешанная копия для второго хеша (double hashing)
+        h1 = fnv1a64(short_code);
+        h2 = mix64(h1) | 1;
+    }
+};
+
+// Операция записи, выполняемая потоком WriteQueue внутри общей транзакции.
+class WriteJob {
+public:
+    virtual ~WriteJob() = default;
+    // Вызывается внутри транзакции пачки, в собственной точке сохранения
+    virtual void execute(WriteConnection& connection) = 0;
+    // Вызывается после COMMIT (error == nullptr) или после отката
+    virtual void complete(std::exception_ptr error) = 0;
+};
+
+// Очередь записи переполнена: запрос отклоняется сразу, а не ждёт своей пачки
+class OverloadedError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Групповая фиксация: задания от всех сессий копятся до write_batch_window
+// или write_batch_max_jobs и выполняются одной транзакцией с одним fsync.
+class WriteQueue {
+public:
+    WriteQueue(WriteConnection& connection, std::chrono::milliseconds window, std::size_t max_jobs)
+        : connection_(connection)
+        , window_(window)
+        , max_jobs_(std::max<std::size_t>(1, max_jobs))
+        , thread_([this] { run(); }) {}
+
+    WriteQueue(const WriteQueue&) = delete;
+    WriteQueue& operator=(const WriteQueue&) = delete;
+
+    ~WriteQueue() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wakeup_.notify_one();
+        thread_.join();
+    }
+
+    void submit(std::unique_ptr<WriteJob> job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.push_back(std::move(job));
+        }
+        wakeup_.notify_one();
+    }
+
+    // Для запросов клиентов: при max_pending заданиях в очереди задание
+    // сразу завершается с OverloadedError
+    void submitBounded(std::unique_ptr<WriteJob> job, std::size_t max_pending) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (pending_.size() < max_pending) {
+                pending_.push_back(std::move(job));
+            }
+        }
+        if (job) {
+            Metrics::instance().writeRejected();
+            job->complete(std::make_exception_ptr(OverloadedError("Write queue is full")));
+            return;
+        }
+        wakeup_.notify_one();
+    }
+
+private:
+    WriteConnection& connection_;
+    std::chrono::milliseconds window_;
+    std::size_t max_jobs_;
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::vector<std::unique_ptr<WriteJob>> pending_;
+    bool stopping_ = false;
+    std::thread thread_;
+
+    void run() {
+        std::vector<std::unique_ptr<WriteJob>> batch;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wakeup_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+                if (pending_.empty()) {
+                    return;
+                }
+                wakeup_.wait_for(lock, window_, [this] {
+                    return stopping_ || pending_.size() >= max_jobs_;
+                });
+
+                const std::size_t count = std::min(pending_.size(), max_jobs_);
+                batch.assign(std::make_move_iterator(pending_.begin()),
+                             std::make_move_iterator(pending_.begin() + count));
+                pending_.erase(pending_.begin(), pending_.begin() + count);
+            }
+            executeBatch(batch);
+            batch.clear();
+        }
+    }
+
+    void executeBatch(std::vector<std::unique_ptr<WriteJob>>& batch) {
+        std::vector<std::exception_ptr> errors(batch.size());
+        std::exception_ptr commit_error;
+        const auto started = std::chrono::steady_clock::now();
+
+        try {
+            SQLite::Database& db = connection_.database();
+            SQLite::Transaction transaction(db);
+            for (std::size_t i = 0; i < batch.size(); ++i) {
+                db.exec("SAVEPOINT write_job");
+                try {
+                    batch[i]->execute(connection_);
+                    db.exec("RELEASE write_job");
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                    db.exec("ROLLBACK TO write_job");
+                    db.exec("RELEASE write_job");
+                }
+            }
+            transaction.commit();
+        } catch (...) {
+            commit_error = std::current_exception();
+        }
+        Metrics::instance().observeQuery(Metrics::Query::Write, std::chrono::steady_clock::now() - started);
+
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            batch[i]->complete(commit_error ? commit_error : errors[i]);
+        }
+    }
+};
+
+// Хранилище коротких ссылок. Сессии работают только через этот интерфейс.
+// Колбэки могут вызываться из любого потока, в том числе прямо внутри вызова.
+class Storage {
+public:
+    using ShortenCallback = std::function<void(std::string short_code, std::exception_ptr error)>;
+    using BatchShortenCallback =
+        std::function<void(std::vector<std::string> short_codes, std::exception_ptr error)>;
+    using ResolveCallback =
+        std::function<void(Lookup result, std::string original_url, std::exception_ptr error)>;
+    // Пустая строка в original_urls — код не найден или ссылка истекла
+    using BatchResolveCallback =
+        std::function<void(std::vector<std::string> original_urls, std::exception_ptr error)>;
+
+    virtual ~Storage() = default;
+
+    // Хранилище этого узла, без пересылки на другие узлы кластера
+    virtual Storage& local() { return *this; }
+
+    // expires_at — unix-время в секундах, после которого ссылка отвечает
+    // Expired; 0 — бессрочная. Бессрочные ссылки на один URL дедуплицируются.
+    virtual void shortenUrlAsync(std::string original_url, std::int64_t expires_at, ShortenCallback callback) = 0;
+
+    // Все URL пакета сохраняются атомарно: при ошибке не сохраняется ни один
+    virtual void shortenUrlsAsync(std::vector<std::string> original_urls, std::int64_t expires_at,
+                                  BatchShortenCallback callback) = 0;
+
+    // Ответ без блокирующего ввода-вывода. std::nullopt — нужен getOriginalUrlAsync.
+    virtual std::optional<Lookup> tryGetOriginalUrl(const std::string& short_code, std::string& original_url) = 0;
+
+    virtual void getOriginalUrlAsync(std::string short_code, ResolveCallback callback) = 0;
+
+    virtual void getOriginalUrlsAsync(std::vector<std::string> short_codes, BatchResolveCallback callback) = 0;
+
+    using ApplyCallback = std::function<void(std::exception_ptr error)>;
+
+    // id последней записи журнала репликации, уже имеющейся в хранилище
+    virtual std::int64_t replicationPosition() {
+        throw std::logic_error("Storage cannot follow a replication log");
+    }
+
+    // Применяет пачку записей журнала, пришедших с первичного узла
+    virtual void applyReplicatedAsync(std::vector<ReplicatedUrl>, ApplyCallback callback) {
+        callback(std::make_exception_ptr(std::logic_error("Storage cannot follow a replication log")));
+    }
+
+    // Хранилище умеет сохранять счётчики переходов
+    virtual bool recordsClicks() const { return false; }
+
+    virtual void recordClicksAsync(std::vector<ClickCount>, ApplyCallback callback) {
+        callback(std::make_exception_ptr(std::logic_error("Storage does not record clicks")));
+    }
+
+    // false — кэш ещё прогревается; /health отвечает 503
+    virtual bool ready() const { return true; }
+
+    // Сохраняет горячие коды кэша для прогрева при следующем старте
+    virtual void saveHotSet() {}
+
+    std::string shortenUrl(const std::string& original_url, std::int64_t expires_at = 0) {
+        std::promise<std::string> result;
+        shortenUrlAsync(original_url, expires_at, [&result](std::string short_code, std::exception_ptr error) {
+            if (error) {
+                result.set_exception(error);
+            } else {
+                result.set_value(std::move(short_code));
+            }
+        });
+        return result.get_future().get();
+    }
+};
+
+unsigned dbReadThreadCount() {
+    if (Config::current().db_read_threads > 0) {
+        return Config::current().db_read_threads;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+class SqliteStorage : public Storage {
+public:
+    SqliteStorage(const std::string& db_path = Config::current().db_path, std::string code_prefix = {})
+        : writer_(db_path, std::move(code_prefix))
+        , readers_(db_path)
+        , cache_(Config::current().url_cache_shards)
+        , filter_(std::max(Config::current().short_code_filter_min_capacity, 2 * writer_.countUrls()),
+                  Config::current().short_code_filter_false_positive_rate)
+        , read_pool_(dbReadThreadCount()) {
+        writer_.forEachShortCode([this](const char* short_code) { filter_.add(short_code); });
+        write_queue_ = std::make_unique<WriteQueue>(writer_, Config::current().write_batch_window,
+                                                    Config::current().write_batch_max_jobs);
+        startWarmup();
+        if (Config::current().link_sweep_interval.count() > 0) {
+            sweeper_ = std::thread([this] { sweepExpiredLinks(); });
+        }
+    }
+
+    ~SqliteStorage() override {
+        {
+            std::lock_guard<std::mutex> lock(sweep_mutex_);
+            stopping_.store(true, std::memory_order_relaxed);
+        }
+        sweep_wakeup_.notify_one();
+        if (warmup_.joinable()) {
+            warmup_.join();
+        }
+        if (sweeper_.joinable()) {
+            sweeper_.join();
+        }
+    }
+
+    // callback вызывается из потока записи после фиксации транзакции
+    void shortenUrlAsync(std::string original_url, std::int64_t expires_at, ShortenCallback callback) override {
+        write_queue_->submitBounded(std::make_unique<ShortenJob>(
+            *this, std::move(original_url), expires_at, std::move(callback)), Config::current().write_queue_max_pending);
+    }
+
+    // Все URL пакета обрабатываются одним заданием, то есть в одной транзакции
+    void shortenUrlsAsync(std::vector<std::string> original_urls, std::int64_t expires_at,
+                          BatchShortenCallback callback) override {
+        write_queue_->submitBounded(std::make_unique<BatchShortenJob>(
+            *this, std::move(original_urls), expires_at, std::move(callback)),
+            Config::current().write_queue_max_pending);
+    }
+
+    // Ответ без обращения к SQLite: из кэша или по фильтру кодов
+    std::optional<Lookup> tryGetOriginalUrl(const std::string& short_code, std::string& original_url) override {
+        if (const auto cached = cache_.get(short_code, original_url)) {
+            return cached;
+        }
+        if (!filter_.mayContain(short_code)) {
+            Metrics::instance().filterRejection();
+            return Lookup::Missing;
+        }
+        return std::nullopt;
+    }
+
+    // Чтение выполняется в пуле потоков базы; callback вызывается оттуда же
+    void getOriginalUrlAsync(std::string short_code, ResolveCallback callback) override {
+        net::post(read_pool_, [this, short_code = std::move(short_code), callback = std::move(callback)] {
+            std::string original_url;
+            Lookup result = Lookup::Missing;
+            std::exception_ptr error;
+            try {
+                result = getOriginalUrl(short_code, original_url);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            callback(result, std::move(original_url), error);
+        });
+    }
+
+    void getOriginalUrlsAsync(std::vector<std::string> short_codes, BatchResolveCallback callback) override {
+        net::post(read_pool_, [this, short_codes = std::move(short_codes), callback = std::move(callback)] {
+            std::vector<std::string> original_urls;
+            std::exception_ptr error;
+            try {
+                original_urls = getOriginalUrls(short_codes);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            callback(std::move(original_urls), error);
+        });
+    }
+
+    std::int64_t replicationPosition() override {
+        return readers_.acquire()->lastUrlId();
+    }
+
+    bool recordsClicks() const override { return true; }
+
+    void recordClicksAsync(std::vector<ClickCount> clicks, ApplyCallback callback) override {
+        write_queue_->submit(std::make_unique<ClicksJob>(std::move(clicks), std::move(callback)));
+    }
+
+    // Пачка применяется одним заданием записи, то есть одной транзакцией
+    void applyReplicatedAsync(std::vector<ReplicatedUrl> rows, ApplyCallback callback) override {
+        write_queue_->submit(std::make_unique<ReplicateJob>(*this, std::move(rows), std::move(callback)));
+    }
+
+    bool ready() const override {
+        return ready_.load(std::memory_order_acquire);
+    }
+
+    // Коды по одному в строке, самые свежие первыми. Файл пишется рядом и
+    // переименовывается, так что оборванная запись не портит прошлый набор.
+    void saveHotSet() override {
+        const std::string& path = Config::current().cache_hot_set_path;
+        if (path.empty()) {
+            return;
+        }
+        const std::vector<std::string> codes = cache_.hotCodes(Config::current().cache_warmup_urls);
+        const std::string temporary = path + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::trunc);
+            for (const auto& code : codes) {
+                out << code << '\n';
+            }
+            if (!out.flush()) {
+                throw std::runtime_error("Cannot write cache hot set to " + temporary);
+            }
+        }
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot replace " + path);
+        }
+    }
+
+    // Результат записывается в original_url, чтобы вызывающий мог
+    // переиспользовать буфер между запросами. Блокирует на время чтения SQLite.
+    // Истёкшая ссылка тоже кэшируется: повторные запросы получат Expired из кэша.
+    Lookup getOriginalUrl(const std::string& short_code, std::string& original_url) {
+        if (const auto answered = tryGetOriginalUrl(short_code, original_url)) {
+            return *answered;
+        }
+
+        const auto started = std::chrono::steady_clock::now();
+        std::int64_t expires_at = 0;
+        const bool found = readers_.acquire()->getOriginalUrl(short_code, original_url, expires_at);
+        Metrics::instance().observeQuery(Metrics::Query::Read, std::chrono::steady_clock::now() - started);
+        if (!found) {
+            return Lookup::Missing;
+        }
+        cache_.put(short_code, original_url, expires_at);
+        if (linkExpired(expires_at)) {
+            original_url.clear();
+            return Lookup::Expired;
+        }
+        return Lookup::Found;
+    }
+
+    std::string getOriginalUrl(const std::string& short_code) {
+        std::string original_url;
+        getOriginalUrl(short_code, original_url);
+        return original_url;
+    }
+
+    // Пустая строка в результате — код не найден или ссылка истекла
+    std::vector<std::string> getOriginalUrls(const std::vector<std::string>& short_codes) {
+        std::vector<std::string> original_urls(short_codes.size());
+        std::vector<std::size_t> misses;
+        for (std::size_t i = 0; i < short_codes.size(); ++i) {
+            if (cache_.get(short_codes[i], original_urls[i])) {
+                continue;
+            }
+            if (filter_.mayContain(short_codes[i])) {
+                misses.push_back(i);
+            } else {
+                Metrics::instance().filterRejection();
+            }
+        }
+
+        if (!misses.empty()) {
+            std::vector<std::int64_t> expires(short_codes.size());
+            const auto started = std::chrono::steady_clock::now();
+            readers_.acquire()->getOriginalUrls(short_codes, misses, original_urls, expires);
+            Metrics::instance().observeQuery(Metrics::Query::Read, std::chrono::steady_clock::now() - started);
+            for (std::size_t i : misses) {
+                if (!original_urls[i].empty()) {
+                    cache_.put(short_codes[i], original_urls[i], expires[i]);
+                    if (linkExpired(expires[i])) {
+                        original_urls[i].clear();
+                    }
+                }
+            }
+        }
+        return original_urls;
+    }
+
+private:
+    class ShortenJob : public WriteJob {
+    public:
+        ShortenJob(SqliteStorage& db, std::string original_url, std::int64_t expires_at, ShortenCallback callback)
+            : db_(db), original_url_(std::move(original_url)), expires_at_(expires_at), callback_(std::move(callback)) {}
+
+        void execute(WriteConnection& connection) override {
+            short_code_ = connection.shortenUrl(original_url_, expires_at_);
+        }
+
+        void complete(std::exception_ptr error) override {
+            if (!error) {
+                db_.filter_.add(short_code_);
+                db_.cache_.put(short_code_, original_url_, expires_at_);
+            }
+            callback_(std::move(short_code_), error);
+        }
+
+    private:
+        SqliteStorage& db_;
+        std::string original_url_;
+        std::int64_t expires_at_;
+        ShortenCallback callback_;
+        std::string short_code_;
+    };
+
+    class BatchShortenJob : public WriteJob {
+    public:
+        BatchShortenJob(SqliteStorage& db, std::vector<std::string> original_urls, std::int64_t expires_at,
+                        BatchShortenCallback callback)
+            : db_(db)
+            , original_urls_(std::move(original_urls))
+            , expires_at_(expires_at)
+            , callback_(std::move(callback)) {}
+
+        void execute(WriteConnection& connection) override {
+            short_codes_.clear();
+            short_codes_.reserve(original_urls_.size());
+            for (const auto& original_url : original_urls_) {
+                short_codes_.push_back(connection.shortenUrl(original_url, expires_at_));
+            }
+        }
+
+        void complete(std::exception_ptr error) override {
+            if (!error) {
+                for (std::size_t i = 0; i < short_codes_.size(); ++i) {
+                    db_.filter_.add(short_codes_[i]);
+                    db_.cache_.put(short_codes_[i], original_urls_[i], expires_at_);
+                }
+            } else {
+                short_codes_.clear();
+            }
+            callback_(std::move(short_codes_), error);
+        }
+
+    private:
+        SqliteStorage& db_;
+        std::vector<std::string> original_urls_;
+        std::int64_t expires_at_;
+        BatchShortenCallback callback_;
+        std::vector<std::string> short_codes_;
+    };
+
+    class ReplicateJob : public WriteJob {
+    public:
+        ReplicateJob(SqliteStorage& db, std::vector<ReplicatedUrl> rows, ApplyCallback callback)
+            : db_(db), rows_(std::move(rows)), callback_(std::move(callback)) {}
+
+        void execute(WriteConnection& connection) override {
+            for (const auto& row : rows_) {
+                connection.insertReplicated(row);
+            }
+        }
+
+        void complete(std::exception_ptr error) override {
+            if (!error) {
+                for (const auto& row : rows_) {
+                    db_.filter_.add(row.short_code);
+                }
+            }
+            callback_(error);
+        }
+
+    private:
+        SqliteStorage& db_;
+        std::vector<ReplicatedUrl> rows_;
+        ApplyCallback callback_;
+    };
+
+    class ClicksJob : public WriteJob {
+    public:
+        ClicksJob(std::vector<ClickCount> clicks, ApplyCallback callback)
+            : clicks_(std::move(clicks)), callback_(std::move(callback)) {}
+
+        void execute(WriteConnection& connection) override {
+            for (const auto& clicks : clicks_) {
+                connection.addClicks(clicks);
+            }
+        }
+
+        void complete(std::exception_ptr error) override {
+            callback_(error);
+        }
+
+    private:
+        std::vector<ClickCount> clicks_;
+        ApplyCallback callback_;
+    };
+
+    class SweepJob : public WriteJob {
+    public:
+        SweepJob(std::vector<ReplicatedUrl> rows, ApplyCallback callback)
+            : rows_(std::move(rows)), callback_(std::move(callback)) {}
+
+        void execute(WriteConnection& connection) override {
+            deleted_ = connection.deleteUrls(rows_);
+        }
+
+        void complete(std::exception_ptr error) override {
+            if (!error) {
+                Metrics::instance().linksSwept(deleted_);
+            }
+            callback_(error);
+        }
+
+    private:
+        std::vector<ReplicatedUrl> rows_;
+        ApplyCallback callback_;
+        std::size_t deleted_ = 0;
+    };
+
+    void startWarmup() {
+        const Config& config = Config::current();
+        if (config.cache_warmup == CacheWarmup::Off && config.cache_hot_set_path.empty()) {
+            ready_.store(true, std::memory_order_release);
+            return;
+        }
+        warmup_ = std::thread([this] {
+            try {
+                warmUp();
+            } catch (const std::exception& e) {
+                std::cerr << "Cache warm-up failed: " << e.what() << std::endl;
+            }
+            ready_.store(true, std::memory_order_release);
+        });
+    }
+
+    // Сначала коды, которые запрашивали перед прошлой остановкой, затем
+    // ссылки по cache_warmup. Коды читаются порциями, чтобы остановка
+    // сервера не ждала весь прогрев.
+    void warmUp() {
+        const auto started = std::chrono::steady_clock::now();
+        const std::size_t limit = Config::current().cache_warmup_urls;
+        std::size_t loaded = 0;
+
+        const std::vector<std::string> codes = readHotSet(limit);
+        std::vector<std::string> original_urls(codes.size());
+        std::vector<std::int64_t> expires(codes.size());
+        constexpr std::size_t chunk = 1024;
+        for (std::size_t begin = 0; begin < codes.size(); begin += chunk) {
+            if (stopping_.load(std::memory_order_relaxed)) {
+                return;
+            }
+            std::vector<std::size_t> indices(std::min(chunk, codes.size() - begin));
+            std::iota(indices.begin(), indices.end(), begin);
+            readers_.acquire()->getOriginalUrls(codes, indices, original_urls, expires);
+            for (std::size_t i : indices) {
+                if (!original_urls[i].empty() && !linkExpired(expires[i])
+                        && cache_.preload(codes[i], original_urls[i], expires[i])) {
+                    ++loaded;
+                }
+            }
+        }
+
+        std::vector<ReplicatedUrl> rows;
+        readers_.acquire()->warmupUrls(Config::current().cache_warmup, limit - std::min(limit, codes.size()), rows);
+        for (const auto& row : rows) {
+            if (stopping_.load(std::memory_order_relaxed)) {
+                return;
+            }
+            if (cache_.preload(row.short_code, row.original_url, row.expires_at)) {
+                ++loaded;
+            }
+        }
+
+        std::cout << "Cache warm-up: " << loaded << " URL(s) in "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::steady_clock::now() - started).count() << " ms" << std::endl;
+    }
+
+    // Кандидаты ищет соединение чтения, поэтому потоку записи остаётся только
+    // удаление по id — одна точка сохранения в общей пачке. Следующая порция —
+    // не раньше link_sweep_interval после фиксации предыдущей. Кэш не
+    // трогается: записи удалённых ссылок вытесняются LRU как обычно.
+    void sweepExpiredLinks() {
+        std::vector<ReplicatedUrl> rows;
+        std::unique_lock<std::mutex> lock(sweep_mutex_);
+        while (!sweep_wakeup_.wait_for(lock, Config::current().link_sweep_interval,
+                                       [this] { return stopping_.load(std::memory_order_relaxed); })) {
+            lock.unlock();
+            try {
+                const Config& config = Config::current();
+                readers_.acquire()->expiredUrls(unixNow() - config.link_expired_retention.count(),
+                                                config.link_sweep_batch, rows);
+                if (!rows.empty()) {
+                    std::promise<void> done;
+                    write_queue_->submit(std::make_unique<SweepJob>(std::move(rows), [&done](std::exception_ptr error) {
+                        if (error) {
+                            done.set_exception(error);
+                        } else {
+                            done.set_value();
+                        }
+                    }));
+                    done.get_future().get();
+                }
+            } catch (const std::exception& e) {
+                std::cerr << "Expired link sweep failed: " << e.what() << std::endl;
+            }
+            lock.lock();
+        }
+    }
+
+    std::vector<std::string> readHotSet(std::size_t limit) const {
+        std::vector<std::string> codes;
+        const std::string& path = Config::current().cache_hot_set_path;
+        if (path.empty()) {
+            return codes;
+        }
+        std::ifstream in(path);
+        std::string line;
+        while (codes.size() < limit && std::getline(in, line)) {
+            if (!line.empty()) {
+                codes.push_back(std::move(line));
+            }
+        }
+        return codes;
+    }
+
+    WriteConnection writer_;
+    ReadConnectionPool readers_;
+    UrlCache cache_;
+    ShortCodeFilter filter_;
+    std::atomic<bool> ready_{false};
+    std::atomic<bool> stopping_{false};
+    std::mutex sweep_mutex_;
+    std::condition_variable sweep_wakeup_;
+    // Завершаются в деструкторе, раньше членов, которыми пользуются
+    std::thread warmup_;
+    std::thread sweeper_;
+    // Останавливается раньше соединений и кэша, которыми пользуются его задачи
+    net::thread_pool read_pool_;
+    // Объявлена последней: поток записи останавливается раньше остальных членов
+    std::unique_ptr<WriteQueue> write_queue_;
+};
+
+// Хранилище целиком в памяти для edge-узлов: открытая адресация по
+// 7-байтовому коду, URL лежат подряд в одной арене. Все ответы — без
+// блокирующего ввода-вывода. Данные не переживают перезапуск: таблица
+// заполняется через insert (например, из снимка) и новыми сокращениями.
+// Истёкшие ссылки не удаляются — таблица без удалений — и отвечают Expired.
+class MemoryStorage : public Storage {
+public:
+    explicit MemoryStorage(std::size_t expected_urls = 0, std::string code_prefix = {})
+        : code_prefix_(std::move(code_prefix))
+        , sequence_(mix64(std::random_device{}()),
+                    Config::current().short_code_length - static_cast<int>(code_prefix_.size())) {
+        std::size_t capacity = 16;
+        while (capacity * MAX_LOAD_PERCENT / 100 < expected_urls) {
+            capacity *= 2;
+        }
+        rehash(capacity);
+    }
+
+    // false — код уже занят или имеет неверную длину
+    bool insert(std::string_view short_code, std::string_view original_url, std::int64_t expires_at = 0) {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        return insertLocked(short_code, original_url, expires_at);
+    }
+
+    std::size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return size_;
+    }
+
+    std::int64_t replicationPosition() override {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return replication_position_;
+    }
+
+    void applyReplicatedAsync(std::vector<ReplicatedUrl> rows, ApplyCallback callback) override {
+        std::exception_ptr error;
+        try {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            for (const auto& row : rows) {
+                insertLocked(row.short_code, row.original_url, row.expires_at);
+                replication_position_ = std::max(replication_position_, row.id);
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+        callback(error);
+    }
+
+    void shortenUrlAsync(std::string original_url, std::int64_t expires_at, ShortenCallback callback) override {
+        std::string short_code;
+        std::exception_ptr error;
+        try {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            short_code = shortenLocked(original_url, expires_at);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        callback(std::move(short_code), error);
+    }
+
+    void shortenUrlsAsync(std::vector<std::string> original_urls, std::int64_t expires_at,
+                          BatchShortenCallback callback) override {
+        std::vector<std::string> short_codes;
+        std::exception_ptr error;
+        try {
+            short_codes.reserve(original_urls.size());
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            for (const auto& original_url : original_urls) {
+                short_codes.push_back(shortenLocked(original_url, expires_at));
+            }
+        } catch (...) {
+            short_codes.clear();
+            error = std::current_exception();
+        }
+        callback(std::move(short_codes), error);
+    }
+
+    std::optional<Lookup> tryGetOriginalUrl(const std::string& short_code, std::string& original_url) override {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        const Slot* slot = findCode(short_code);
+        if (!slot) {
+            return Lookup::Missing;
+        }
+        if (linkExpired(slot->expires_at)) {
+            return Lookup::Expired;
+        }
+        original_url.assign(arena_.data() + slot->url_offset, slot->url_length);
+        return Lookup::Found;
+    }
+
+    void getOriginalUrlAsync(std::string short_code, ResolveCallback callback) override {
+        std::string original_url;
+        const Lookup result = *tryGetOriginalUrl(short_code, original_url);
+        callback(result, std::move(original_url), nullptr);
+    }
+
+    void getOriginalUrlsAsync(std::vector<std::string> short_codes, BatchResolveCallback callback) override {
+        std::vector<std::string> original_urls(short_codes.size());
+        for (std::size_t i = 0; i < short_codes.size(); ++i) {
+            tryGetOriginalUrl(short_codes[i], original_urls[i]);
+        }
+        callback(std::move(original_urls), nullptr);
+    }
+
+private:
+    static constexpr std::size_t MAX_LOAD_PERCENT = 70;
+    static constexpr std::uint32_t EMPTY = UINT32_MAX;
+
+    struct Slot {
+        std::array<char, MAX_SHORT_CODE_LENGTH> code;
+        bool used = false;
+        std::uint32_t url_length = 0;
+        std::uint64_t url_offset = 0;
+        std::int64_t expires_at = 0;
+    };
+
+    const std::size_t code_length_ = static_cast<std::size_t>(Config::current().short_code_length);
+    mutable std::shared_mutex mutex_;
+    // Размеры обеих таблиц — одна и та же степень двойки
+    std::vector<Slot> slots_;
+    // Индекс для дедупликации бессрочных ссылок: хеш URL -> номер слота в slots_
+    std::vector<std::uint32_t> by_url_;
+    std::vector<char> arena_;
+    std::size_t size_ = 0;
+    const std::string code_prefix_;
+    SequenceCodeGenerator sequence_;
+    std::uint64_t next_id_ = 0;
+    std::int64_t replication_position_ = 0;
+
+    std::size_t mask() const { return slots_.size() - 1; }
+
+    static std::size_t codeHash(std::string_view short_code) {
+        return mix64(fnv1a64(short_code));
+    }
+
+    std::string_view urlAt(const Slot& slot) const {
+        return std::string_view(arena_.data() + slot.url_offset, slot.url_length);
+    }
+
+    const Slot* findCode(std::string_view short_code) const {
+        if (short_code.size() != code_length_) {
+            return nullptr;
+        }
+        for (std::size_t i = codeHash(short_code) & mask();; i = (i + 1) & mask()) {
+            const Slot& slot = slots_[i];
+            if (!slot.used) {
+                return nullptr;
+            }
+            if (std::memcmp(slot.code.data(), short_code.data(), code_length_) == 0) {
+                return &slot;
+            }
+        }
+    }
+
+    const Slot* findUrl(std::string_view original_url) const {
+        for (std::size_t i = static_cast<std::uint64_t>(urlHash(original_url)) & mask();; i = (i + 1) & mask()) {
+            if (by_url_[i] == EMPTY) {
+                return nullptr;
+            }
+            const Slot& slot = slots_[by_url_[i]];
+            if (urlAt(slot) == original_url) {
+                return &slot;
+            }
+        }
+    }
+
+    void indexUrl(std::uint32_t slot_index) {
+        const std::string_view original_url = urlAt(slots_[slot_index]);
+        std::size_t i = static_cast<std::uint64_t>(urlHash(original_url)) & mask();
+        while (by_url_[i] != EMPTY) {
+            i = (i + 1) & mask();
+        }
+        by_url_[i] = slot_index;
+    }
+
+    std::uint32_t placeCode(const Slot& source) {
+        const std::string_view short_code(source.code.data(), code_length_);
+        std::size_t i = codeHash(short_code) & mask();
+        while (slots_[i].used) {
+            i = (i + 1) & mask();
+        }
+        slots_[i] = source;
+        return static_cast<std::uint32_t>(i);
+    }
+
+    void rehash(std::size_t capacity) {
+        std::vector<Slot> old_slots(capacity);
+        old_slots.swap(slots_);
+        by_url_.assign(capacity, EMPTY);
+        for (const Slot& slot : old_slots) {
+            if (slot.used) {
+                const std::uint32_t index = placeCode(slot);
+                if (slot.expires_at == 0 && !findUrl(urlAt(slot))) {
+                    indexUrl(index);
+                }
+            }
+        }
+    }
+
+    bool insertLocked(std::string_view short_code, std::string_view original_url, std::int64_t expires_at) {
+        if (short_code.size() != code_length_ || findCode(short_code)) {
+            return false;
+        }
+        if ((size_ + 1) * 100 > slots_.size() * MAX_LOAD_PERCENT) {
+            rehash(slots_.size() * 2);
+        }
+
+        Slot slot;
+        std::memcpy(slot.code.data(), short_code.data(), code_length_);
+        slot.used = true;
+        slot.url_length = static_cast<std::uint32_t>(original_url.size());
+        slot.url_offset = arena_.size();
+        slot.expires_at = expires_at;
+        const bool skip_index = expires_at != 0 || findUrl(original_url) != nullptr;
+        arena_.insert(arena_.end(), original_url.begin(), original_url.end());
+
+        const std::uint32_t index = placeCode(slot);
+        if (!skip_index) {
+            indexUrl(index);
+        }
+        ++size_;
+        return true;
+    }
+
+    std::string shortenLocked(const std::string& original_url, std::int64_t expires_at) {
+        if (expires_at == 0) {
+            if (const Slot* slot = findUrl(original_url)) {
+                return std::string(slot->code.data(), code_length_);
+            }
+        }
+        for (;;) {
+            const std::string short_code = code_prefix_ + (Config::current().code_generator_mode == CodeGeneratorMode::Sequence
+                ? sequence_.generate(next_id_++)
+                : CodeGenerator::generate(static_cast<int>(code_length_ - code_prefix_.size())));
+            if (insertLocked(short_code, original_url, expires_at)) {
+                return short_code;
+            }
+        }
+    }
+};
+
+// Неизменяемый снимок short_code -> original_url для read-реплик.
+// Файл отображается в память как есть, без десериализации, и страницы
+// делятся между процессами через page cache. Формат (порядок байт — родной):
+//   SnapshotHeader
+//   SnapshotRecord[count], отсортированы по коду для двоичного поиска
+//   URL подряд, без разделителей
+struct SnapshotHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t code_length;
+    std::uint64_t count;
+    std::uint64_t blob_size;
+};
+
+struct SnapshotRecord {
+    char code[8];
+    std::uint64_t url_offset;
+    std::uint32_t url_length;
+    // unix-время истечения ссылки, 0 — бессрочная
+    std::uint32_t expires_at;
+};
+
+static_assert(MAX_SHORT_CODE_LENGTH <= 8, "SnapshotRecord stores codes in 8 bytes");
+static_assert(sizeof(SnapshotHeader) == 32 && sizeof(SnapshotRecord) == 24, "Snapshot layout must be stable");
+
+constexpr char SNAPSHOT_MAGIC[8] = {'U', 'R', 'L', 'S', 'N', 'A', 'P', '\0'};
+constexpr std::uint32_t SNAPSHOT_VERSION = 1;
+
+// Снимок пишется во временный файл и атомарно переименовывается, так что
+// работающие реплики никогда не видят недописанный файл. Уже истёкшие
+// ссылки в снимок не попадают.
+std::uint64_t exportSnapshot(const std::string& db_path, const std::string& snapshot_path) {
+    SQLite::Database db(db_path, SQLite::OPEN_READONLY, Config::current().sqlite_pragmas.busy_timeout_ms);
+    // Подсчёт и выгрузка в одной транзакции видят одно и то же состояние
+    SQLite::Transaction transaction(db);
+    const std::int64_t now = unixNow();
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.code_length = Config::current().short_code_length;
+    {
+        SQLite::Statement totals(db, "SELECT COUNT(*), COALESCE(SUM(LENGTH(CAST(original_url AS BLOB))), 0) "
+                                     "FROM urls WHERE expires_at IS NULL OR expires_at > ?");
+        totals.bind(1, now);
+        totals.executeStep();
+        header.count = static_cast<std::uint64_t>(totals.getColumn(0).getInt64());
+        header.blob_size = static_cast<std::uint64_t>(totals.getColumn(1).getInt64());
+    }
+
+    const std::string temp_path = snapshot_path + ".tmp";
+    std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("Cannot create snapshot file " + temp_path);
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    // Записи идут в начало файла, URL — в буфер, который дописывается следом.
+    // BINARY-сравнение SQLite совпадает с memcmp, поэтому порядок готов для поиска.
+    SQLite::Statement rows(db, "SELECT short_code, original_url, expires_at FROM urls "
+                               "WHERE expires_at IS NULL OR expires_at > ? ORDER BY short_code");
+    rows.bind(1, now);
+    std::string blob;
+    blob.reserve(header.blob_size);
+    std::uint64_t written = 0;
+    while (rows.executeStep()) {
+        const std::string_view short_code = rows.getColumn(0).getText();
+        const SQLite::Column url = rows.getColumn(1);
+        if (short_code.size() != header.code_length || written == header.count) {
+            throw std::runtime_error("Unexpected row in urls while exporting snapshot");
+        }
+
+        SnapshotRecord record{};
+        std::memcpy(record.code, short_code.data(), short_code.size());
+        record.url_offset = blob.size();
+        record.url_length = static_cast<std::uint32_t>(url.getBytes());
+        record.expires_at = static_cast<std::uint32_t>(rows.getColumn(2).getInt64());
+        blob.append(url.getText(), record.url_length);
+        out.write(reinterpret_cast<const char*>(&record), sizeof(record));
+        ++written;
+    }
+    if (written != header.count || blob.size() != header.blob_size) {
+        throw std::runtime_error("urls changed while exporting snapshot");
+    }
+    out.write(blob.data(), static_cast<std::streamsize>(blob.size()));
+    out.close();
+    if (!out) {
+        throw std::runtime_error("Cannot write snapshot file " + temp_path);
+    }
+    if (std::rename(temp_path.c_str(), snapshot_path.c_str()) != 0) {
+        throw std::system_error(errno, std::generic_category(), "Cannot rename snapshot to " + snapshot_path);
+    }
+    return written;
+}
+
+// Read-only отображение файла снимка
+class SnapshotFile {
+public:
+    explicit SnapshotFile(const std::string& path) {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot open snapshot " + path);
+        }
+        struct stat info{};
+        if (::fstat(fd, &info) != 0) {
+            const int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "Cannot stat snapshot " + path);
+        }
+        size_ = static_cast<std::size_t>(info.st_size);
+        if (size_ < sizeof(SnapshotHeader)) {
+            ::close(fd);
+            throw std::runtime_error("Snapshot " + path + " is truncated");
+        }
+        void* data = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "Cannot map snapshot " + path);
+        }
+        data_ = static_cast<const char*>(data);
+        // Поиск обращается к записям вразнобой: упреждающее чтение бесполезно
+        ::madvise(data, size_, MADV_RANDOM);
+
+        const auto& header = *reinterpret_cast<const SnapshotHeader*>(data_);
+        if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+            || header.version != SNAPSHOT_VERSION
+            || header.code_length != static_cast<std::uint32_t>(Config::current().short_code_length)
+            || header.count > (size_ - sizeof(SnapshotHeader)) / sizeof(SnapshotRecord)
+            || header.blob_size != size_ - sizeof(SnapshotHeader) - header.count * sizeof(SnapshotRecord)) {
+            ::munmap(const_cast<char*>(data_), size_);
+            throw std::runtime_error("Snapshot " + path + " has an unsupported or corrupt header");
+        }
+        records_ = reinterpret_cast<const SnapshotRecord*>(data_ + sizeof(SnapshotHeader));
+        count_ = header.count;
+        code_length_ = header.code_length;
+        blob_ = reinterpret_cast<const char*>(records_ + count_);
+        blob_size_ = header.blob_size;
+    }
+
+    SnapshotFile(const SnapshotFile&) = delete;
+    SnapshotFile& operator=(const SnapshotFile&) = delete;
+
+    ~SnapshotFile() {
+        ::munmap(const_cast<char*>(data_), size_);
+    }
+
+    std::uint64_t size() const { return count_; }
+
+    // nullptr — кода нет; границы URL записи проверены
+    const SnapshotRecord* find(std::string_view short_code) const {
+        if (short_code.size() != code_length_) {
+            return nullptr;
+        }
+        const SnapshotRecord* end = records_ + count_;
+        const SnapshotRecord* record = std::lower_bound(records_, end, short_code,
+            [](const SnapshotRecord& item, std::string_view code) {
+                return std::memcmp(item.code, code.data(), code.size()) < 0;
+            });
+        if (record == end || std::memcmp(record->code, short_code.data(), short_code.size()) != 0
+            || record->url_offset + record->url_length > blob_size_) {
+            return nullptr;
+        }
+        return record;
+    }
+
+    // string_view указывает прямо в отображённый файл
+    std::string_view url(const SnapshotRecord& record) const {
+        return std::string_view(blob_ + record.url_offset, record.url_length);
+    }
+
+private:
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+    const SnapshotRecord* records_ = nullptr;
+    std::uint64_t count_ = 0;
+    std::size_t code_length_ = 0;
+    const char* blob_ = nullptr;
+    std::uint64_t blob_size_ = 0;
+};
+
+// Хранилище read-реплики поверх снимка: старт — это только mmap,
+// сокращение новых URL отклоняется
+class SnapshotStorage : public Storage {
+public:
+    explicit SnapshotStorage(const std::string& snapshot_path = Config::current().snapshot_path)
+        : snapshot_(snapshot_path) {}
+
+    void shortenUrlAsync(std::string, std::int64_t, ShortenCallback callback) override {
+        callback({}, readOnlyError());
+    }
+
+    void shortenUrlsAsync(std::vector<std::string>, std::int64_t, BatchShortenCallback callback) override {
+        callback({}, readOnlyError());
+    }
+
+    std::optional<Lookup> tryGetOriginalUrl(const std::string& short_code, std::string& original_url) override {
+        const SnapshotRecord* record = snapshot_.find(short_code);
+        if (!record) {
+            return Lookup::Missing;
+        }
+        if (linkExpired(record->expires_at)) {
+            return Lookup::Expired;
+        }
+        const std::string_view url = snapshot_.url(*record);
+        original_url.assign(url.data(), url.size());
+        return Lookup::Found;
+    }
+
+    void getOriginalUrlAsync(std::string short_code, ResolveCallback callback) override {
+        std::string original_url;
+        const Lookup result = *tryGetOriginalUrl(short_code, original_url);
+        callback(result, std::move(original_url), nullptr);
+    }
+
+    void getOriginalUrlsAsync(std::vector<std::string> short_codes, BatchResolveCallback callback) override {
+        std::vector<std::string> original_urls(short_codes.size());
+        for (std::size_t i = 0; i < short_codes.size(); ++i) {
+            tryGetOriginalUrl(short_codes[i], original_urls[i]);
+        }
+        callback(std::move(original_urls), nullptr);
+    }
+
+private:
+    SnapshotFile snapshot_;
+
+    static std::exception_ptr readOnlyError() {
+        return std::make_exception_ptr(std::runtime_error("Storage is a read-only snapshot"));
+    }
+};
+
+// Тело пакетного запроса: URL/коды по одному в строке или JSON-массив строк.
+// Ответ возвращается в том же формате и в том же порядке.
+class BatchFormat {
+public:
+    explicit BatchFormat(bool json) : json_(json) {}
+
+    static BatchFormat detect(std::string_view content_type, std::string_view body) {
+        const auto first = body.find_first_not_of(" \t\r\n");
+        return BatchFormat(content_type.find("json") != std::string_view::npos
+                           || (first != std::string_view::npos && body[first] == '['));
+    }
+
+    std::string_view contentType() const { return json_ ? "application/json" : "text/plain"; }
+
+    std::vector<std::string> parse(std::string_view body) const {
+        return json_ ? parseJson(body, false) : parseLines(body);
+    }
+
+    // Разбор ответа пакетного запроса: null в JSON и пустые строки в тексте
+    // (ненайденные коды) дают пустые элементы
+    std::vector<std::string> parseResults(std::string_view body) const {
+        if (json_) {
+            return parseJson(body, true);
+        }
+        std::vector<std::string> items;
+        while (!body.empty()) {
+            const auto end = body.find('\n');
+            items.emplace_back(body.substr(0, end));
+            body = end == std::string_view::npos ? std::string_view{} : body.substr(end + 1);
+        }
+        return items;
+    }
+
+    void begin(std::string& out) const {
+        if (json_) {
+            out += '[';
+        }
+    }
+
+    // value == nullptr — нет результата (null в JSON, пустая строка в тексте)
+    void append(std::string& out, const std::string* value, bool first) const {
+        if (json_) {
+            if (!first) {
+                out += ',';
+            }
+            if (value) {
+                appendJsonString(out, *value);
+            } else {
+                out += "null";
+            }
+        } else {
+            if (value) {
+                out += *value;
+            }
+            out += '\n';
+        }
+    }
+
+    void end(std::string& out) const {
+        if (json_) {
+            out += ']';
+        }
+    }
+
+private:
+    bool json_;
+
+    // Каждая строка, в том числе пустая, — отдельный элемент, чтобы строки
+    // ответа совпадали со строками запроса; отбрасывается только перевод
+    // строки в конце тела
+    static std::vector<std::string> parseLines(std::string_view body) {
+        std::vector<std::string> items;
+        if (!body.empty() && body.back() == '\n') {
+            body.remove_suffix(1);
+        }
+        if (body.empty()) {
+            return items;
+        }
+        for (;;) {
+            const auto end = body.find('\n');
+            std::string_view line = body.substr(0, end);
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            items.emplace_back(line);
+            if (end == std::string_view::npos) {
+                return items;
+            }
+            body.remove_prefix(end + 1);
+        }
+    }
+
+    static std::vector<std::string> parseJson(std::string_view body, bool allow_null) {
+        std::vector<std::string> items;
+        std::size_t pos = 0;
+        auto skipSpaces = [&] {
+            while (pos < body.size()
+                   && (body[pos] == ' ' || body[pos] == '\t' || body[pos] == '\r' || body[pos] == '\n')) {
+                ++pos;
+            }
+        };
+        auto expect = [&](char c) {
+            skipSpaces();
+            if (pos >= body.size() || body[pos] != c) {
+                throw std::invalid_argument(std::string("Malformed JSON batch: expected '") + c + "'");
+            }
+            ++pos;
+        };
+
+        expect('[');
+        skipSpaces();
+        if (pos < body.size() && body[pos] == ']') {
+            ++pos;
+        } else {
+            for (;;) {
+                skipSpaces();
+                if (allow_null && body.substr(pos, 4) == "null") {
+                    pos += 4;
+                    items.emplace_back();
+                } else {
+                    expect('"');
+                    items.push_back(parseJsonString(body, pos));
+                }
+                skipSpaces();
+                if (pos < body.size() && body[pos] == ',') {
+                    ++pos;
+                    continue;
+                }
+                expect(']');
+                break;
+            }
+        }
+        skipSpaces();
+        if (pos != body.size()) {
+            throw std::invalid_argument("Malformed JSON batch: trailing data");
+        }
+        return items;
+    }
+
+    // pos указывает на символ после открывающей кавычки
+    static std::string parseJsonString(std::string_view body, std::size_t& pos) {
+        std::string value;
+        while (pos < body.size()) {
+            const char c = body[pos++];
+            if (c == '"') {
+                return value;
+            }
+            if (c != '\\') {
+                value += c;
+                continue;
+            }
+            if (pos >= body.size()) {
+                break;
+            }
+            const char escaped = body[pos++];
+            switch (escaped) {
+            case '"': value += '"'; break;
+            case '\\': value += '\\'; break;
+            case '/': value += '/'; break;
+            case 'b': value += '\b'; break;
+            case 'f': value += '\f'; break;
+            case 'n': value += '\n'; break;
+            case 'r': value += '\r'; break;
+            case 't': value += '\t'; break;
+            case 'u': {
+                std::uint32_t code_point = parseHex4(body, pos);
+                if (code_point >= 0xD800 && code_point < 0xDC00
+                    && body.substr(pos, 2) == "\\u") {
+                    pos += 2;
+                    const std::uint32_t low = parseHex4(body, pos);
+                    code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+                }
+                appendUtf8(value, code_point);
+                break;
+            }
+            default:
+                throw std::invalid_argument("Malformed JSON batch: bad escape");
+            }
+        }
+        throw std::invalid_argument("Malformed JSON batch: unterminated string");
+    }
+
+    static std::uint32_t parseHex4(std::string_view body, std::size_t& pos) {
+        if (pos + 4 > body.size()) {
+            throw std::invalid_argument("Malformed JSON batch: bad \\u escape");
+        }
+        std::uint32_t value = 0;
+        for (int i = 0; i < 4; ++i) {
+            const char c = body[pos++];
+            value <<= 4;
+            if (c >= '0' && c <= '9') value |= c - '0';
+            else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+            else throw std::invalid_argument("Malformed JSON batch: bad \\u escape");
+        }
+        return value;
+    }
+
+    static void appendUtf8(std::string& out, std::uint32_t code_point) {
+        if (code_point < 0x80) {
+            out += static_cast<char>(code_point);
+        } else if (code_point < 0x800) {
+            out += static_cast<char>(0xC0 | (code_point >> 6));
+            out += static_cast<char>(0x80 | (code_point & 0x3F));
+        } else if (code_point < 0x10000) {
+            out += static_cast<char>(0xE0 | (code_point >> 12));
+            out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code_point & 0x3F));
+        } else {
+            out += static_cast<char>(0xF0 | (code_point >> 18));
+            out += static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code_point & 0x3F));
+        }
+    }
+
+    static void appendJsonString(std::string& out, const std::string& value) {
+        static constexpr char hex[] = "0123456789abcdef";
+        out += '"';
+        for (unsigned char c : value) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += static_cast<char>(c);
+            } else if (c < 0x20) {
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 0xF];
+            } else {
+                out += static_cast<char>(c);
+            }
+        }
+        out += '"';
+    }
+};
+
+struct RouteMatch {
+    Route route;
+    // Указывает внутрь target запроса, без копирования
+    std::string_view argument;
+};
+
+// Разбор target без регулярных выражений и выделения памяти: префиксы
+// сравниваются через string_view, алфавит кода проверяется по таблице.
+class Router {
+public:
+    static RouteMatch match(http::verb method, std::string_view target) {
+        static constexpr std::string_view shorten_prefix = "/makeshort/";
+
+        if (target == "/" || target == "/health") {
+            return {Route::Health, {}};
+        }
+        if (target == "/metrics") {
+            return {Route::Metrics, {}};
+        }
+        if (method == http::verb::post && target == "/makeshort/batch") {
+            return {Route::ShortenBatch, {}};
+        }
+        if (method == http::verb::post && target == "/resolve/batch") {
+            return {Route::ResolveBatch, {}};
+        }
+        if (target.size() > shorten_prefix.size()
+            && target.substr(0, shorten_prefix.size()) == shorten_prefix) {
+            return {Route::Shorten, target.substr(shorten_prefix.size())};
+        }
+        if (target.size() > 1 && target[0] == '/' && isShortCode(target.substr(1))) {
+            return {Route::Resolve, target.substr(1)};
+        }
+        return {Route::BadRequest, {}};
+    }
+
+    static bool isShortCode(std::string_view code) {
+        for (unsigned char c : code) {
+            if (!CODE_CHAR_TABLE[c]) {
+                return false;
+            }
+        }
+        return !code.empty();
+    }
+
+private:
+    static constexpr std::array<bool, 256> CODE_CHAR_TABLE = [] {
+        std::array<bool, 256> table{};
+        for (char c : CODE_ALPHABET) {
+            table[static_cast<unsigned char>(c)] = true;
+        }
+        return table;
+    }();
+};
+
+// Таблица значений шестнадцатеричных цифр; -1 — не цифра
+constexpr std::array<std::int8_t, 256> HEX_DIGIT_TABLE = [] {
+    std::array<std::int8_t, 256> table{};
+    for (auto& value : table) {
+        value = -1;
+    }
+    for (int c = '0'; c <= '9'; ++c) table[c] = static_cast<std::int8_t>(c - '0');
+    for (int c = 'a'; c <= 'f'; ++c) table[c] = static_cast<std::int8_t>(c - 'a' + 10);
+    for (int c = 'A'; c <= 'F'; ++c) table[c] = static_cast<std::int8_t>(c - 'A' + 10);
+    return table;
+}();
+
+// Декодирует в переданный буфер, сохраняя его ёмкость между вызовами.
+// '%' без двух шестнадцатеричных цифр следом остаётся как есть.
+void urlDecode(std::string_view encoded, std::string& decoded) {
+    decoded.clear();
+    decoded.reserve(encoded.size());
+    for (std::size_t i = 0; i < encoded.size(); ++i) {
+        const char c = encoded[i];
+        if (c == '%' && i + 2 < encoded.size()) {
+            const int high = HEX_DIGIT_TABLE[static_cast<unsigned char>(encoded[i + 1])];
+            const int low = HEX_DIGIT_TABLE[static_cast<unsigned char>(encoded[i + 2])];
+            if (high >= 0 && low >= 0) {
+                decoded += static_cast<char>((high << 4) | low);
+                i += 2;
+                continue;
+            }
+        }
+        decoded += c == '+' ? ' ' : c;
+    }
+}
+
+std::string urlDecode(std::string_view encoded) {
+    std::string decoded;
+    urlDecode(encoded, decoded);
+    return decoded;
+}
+
+// Первый символ кода узла node: по нему код маршрутизируется к владельцу
+std::string clusterCodePrefix(std::size_t node) {
+    return std::string(1, CODE_ALPHABET[node]);
+}
+
+// Кольцо согласованного хеширования: каждый узел занимает
+// cluster_virtual_nodes точек, ключ принадлежит первой точке не меньше его
+// хеша. При добавлении узла переезжает лишь ~1/N ключей.
+class HashRing {
+public:
+    explicit HashRing(const std::vector<std::string>& nodes) : node_count_(nodes.size()) {
+        for (std::size_t node = 0; node < nodes.size(); ++node) {
+            for (int i = 0; i < Config::current().cluster_virtual_nodes; ++i) {
+                points_.emplace_back(mix64(fnv1a64(nodes[node] + "#" + std::to_string(i))), node);
+            }
+        }
+        std::sort(points_.begin(), points_.end());
+    }
+
+    std::size_t ownerOfHash(std::uint64_t hash) const {
+        auto point = std::lower_bound(points_.begin(), points_.end(), std::make_pair(hash, std::size_t{0}));
+        if (point == points_.end()) {
+            point = points_.begin();
+        }
+        return point->second;
+    }
+
+    // Владелец кода записан в нём самом, а не выводится из кольца: добавление
+    // узлов в конец cluster_nodes и смена их адресов не переносят выданные коды.
+    // Кодов с чужим первым символом ни один узел не выдавал — их отвечает узел 0.
+    std::size_t ownerOfCode(std::string_view short_code) const {
+        const std::size_t node = short_code.empty() ? 0 : CODE_ALPHABET.find(short_code.front());
+        return node < node_count_ ? node : 0;
+    }
+
+    // Сокращение идёт на узел по хешу URL, чтобы повторный URL попадал
+    // туда же и дедуплицировался. После добавления узла часть URL переезжает,
+    // и повторное сокращение такого URL один раз выдаст ещё один код.
+    std::size_t ownerOfUrl(std::string_view original_url) const {
+        return ownerOfHash(static_cast<std::uint64_t>(urlHash(original_url)));
+    }
+
+private:
+    std::size_t node_count_;
+    std::vector<std::pair<std::uint64_t, std::size_t>> points_;
+};
+
+// "host:port" -> {host, port}
+std::pair<std::string, std::string> splitHostPort(const std::string& address) {
+    const auto colon = address.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == address.size()) {
+        throw std::invalid_argument("Address must be host:port, got " + address);
+    }
+    return {address.substr(0, colon), address.substr(colon + 1)};
+}
+
+using PeerStream = beast::tcp_stream;
+
+// Простаивающие keep-alive соединения к одному узлу кластера
+class PeerConnectionPool {
+public:
+    PeerConnectionPool(net::io_context& ioc, const std::string& address)
+        : ioc_(ioc), address_(address) {
+        std::tie(host_, port_) = splitHostPort(address);
+    }
+
+    net::io_context& context() { return ioc_; }
+    const std::string& address() const { return address_; }
+    const std::string& host() const { return host_; }
+    const std::string& port() const { return port_; }
+
+    std::unique_ptr<PeerStream> acquire() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (idle_.empty()) {
+            return nullptr;
+        }
+        auto stream = std::move(idle_.back());
+        idle_.pop_back();
+        return stream;
+    }
+
+    void release(std::unique_ptr<PeerStream> stream) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (idle_.size() < Config::current().cluster_peer_max_idle) {
+            idle_.push_back(std::move(stream));
+        }
+    }
+
+private:
+    net::io_context& ioc_;
+    std::string address_;
+    std::string host_;
+    std::string port_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<PeerStream>> idle_;
+};
+
+// Один запрос к узлу-владельцу. Сначала пробует соединение из пула; если
+// узел успел его закрыть, повторяет запрос один раз по новому соединению.
+class PeerRequest : public std::enable_shared_from_this<PeerRequest> {
+public:
+    using Callback = std::function<void(beast::error_code ec, http::response<http::string_body> response)>;
+
+    PeerRequest(PeerConnectionPool& peer, http::request<http::string_body> request, Callback callback)
+        : peer_(peer)
+        , resolver_(net::make_strand(peer.context()))
+        , request_(std::move(request))
+        , callback_(std::move(callback)) {
+        request_.set(http::field::host, peer_.host());
+        request_.set(CLUSTER_FORWARDED_HEADER, "1");
+        request_.keep_alive(true);
+        request_.prepare_payload();
+    }
+
+    void start() {
+        stream_ = peer_.acquire();
+        reused_ = stream_ != nullptr;
+        if (stream_) {
+            write();
+        } else {
+            connect();
+        }
+    }
+
+private:
+    PeerConnectionPool& peer_;
+    tcp::resolver resolver_;
+    std::unique_ptr<PeerStream> stream_;
+    bool reused_ = false;
+    http::request<http::string_body> request_;
+    beast::flat_buffer buffer_;
+    http::response<http::string_body> response_;
+    Callback callback_;
+
+    void connect() {
+        auto self = shared_from_this();
+        resolver_.async_resolve(peer_.host(), peer_.port(),
+            [self](beast::error_code ec, tcp::resolver::results_type results) {
+                if (ec) {
+                    self->fail(ec);
+                    return;
+                }
+                self->stream_ = std::make_unique<PeerStream>(net::make_strand(self->peer_.context()));
+                self->stream_->expires_after(Config::current().cluster_forward_timeout);
+                self->stream_->async_connect(results,
+                    [self](beast::error_code ec, const tcp::endpoint&) {
+                        if (ec) {
+                            self->fail(ec);
+                            return;
+                        }
+                        self->write();
+                    });
+            });
+    }
+
+    void write() {
+        stream_->expires_after(Config::current().cluster_forward_timeout);
+        auto self = shared_from_this();
+        http::async_write(*stream_, request_, [self](beast::error_code ec, std::size_t) {
+            if (ec) {
+                self->fail(ec);
+                return;
+            }
+            http::async_read(*self->stream_, self->buffer_, self->response_,
+                [self](beast::error_code ec, std::size_t) {
+                    if (ec) {
+                        self->fail(ec);
+                        return;
+                    }
+                    self->stream_->expires_never();
+                    if (self->response_.keep_alive()) {
+                        self->peer_.release(std::move(self->stream_));
+                    }
+                    self->callback_({}, std::move(self->response_));
+                });
+        });
+    }
+
+    void fail(beast::error_code ec) {
+        stream_.reset();
+        if (reused_) {
+            reused_ = false;
+            buffer_.clear();
+            response_ = {};
+            connect();
+            return;
+        }
+        callback_(ec, {});
+    }
+};
+
+// Кластерный режим: пространство кодов делится между cluster_nodes по
+// кольцу. Запросы к своим ключам идут в локальное хранилище, к чужим —
+// пересылаются владельцу. Пакеты делятся по владельцам; части пакета на
+// разных узлах фиксируются независимо.
+class ClusterStorage : public Storage {
+public:
+    ClusterStorage(std::shared_ptr<const HashRing> ring, std::size_t self,
+                   const std::vector<std::string>& nodes, std::shared_ptr<Storage> local)
+        : ring_(std::move(ring))
+        , self_(self)
+        , local_(std::move(local))
+        , work_(net::make_work_guard(ioc_)) {
+        for (const auto& node : nodes) {
+            peers_.push_back(std::make_unique<PeerConnectionPool>(ioc_, node));
+        }
+        for (unsigned i = 0; i < Config::current().cluster_forward_threads; ++i) {
+            threads_.emplace_back([this] { ioc_.run(); });
+        }
+    }
+
+    ~ClusterStorage() override {
+        work_.reset();
+        ioc_.stop();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    Storage& local() override { return *local_; }
+
+    // Переходы считаются на узле, принявшем запрос клиента: владелец кода
+    // пересланный ему переход не учитывает
+    bool recordsClicks() const override { return local_->recordsClicks(); }
+
+    void recordClicksAsync(std::vector<ClickCount> clicks, ApplyCallback callback) override {
+        local_->recordClicksAsync(std::move(clicks), std::move(callback));
+    }
+
+    bool ready() const override { return local_->ready(); }
+
+    void saveHotSet() override { local_->saveHotSet(); }
+
+    void shortenUrlAsync(std::string original_url, std::int64_t expires_at, ShortenCallback callback) override {
+        const std::size_t owner = ring_->ownerOfUrl(original_url);
+        if (owner == self_) {
+            local_->shortenUrlAsync(std::move(original_url), expires_at, std::move(callback));
+            return;
+        }
+        forwardShorten(owner, {std::move(original_url)}, expires_at,
+            [callback = std::move(callback)](std::vector<std::string> short_codes, std::exception_ptr error) {
+                callback(error ? std::string() : std::move(short_codes.front()), error);
+            });
+    }
+
+    void shortenUrlsAsync(std::vector<std::string> original_urls, std::int64_t expires_at,
+                          BatchShortenCallback callback) override {
+        scatter<BatchShortenCallback>(std::move(original_urls),
+            [this](std::string_view original_url) { return ring_->ownerOfUrl(original_url); },
+            [this, expires_at](std::size_t owner, std::vector<std::string> items, BatchShortenCallback done) {
+                if (owner == self_) {
+                    local_->shortenUrlsAsync(std::move(items), expires_at, std::move(done));
+                } else {
+                    forwardShorten(owner, std::move(items), expires_at, std::move(done));
+                }
+            },
+            std::move(callback));
+    }
+
+    std::optional<Lookup> tryGetOriginalUrl(const std::string& short_code, std::string& original_url) override {
+        if (ring_->ownerOfCode(short_code) != self_) {
+            return std::nullopt;
+        }
+        return local_->tryGetOriginalUrl(short_code, original_url);
+    }
+
+    void getOriginalUrlAsync(std::string short_code, ResolveCallback callback) override {
+        const std::size_t owner = ring_->ownerOfCode(short_code);
+        if (owner == self_) {
+            local_->getOriginalUrlAsync(std::move(short_code), std::move(callback));
+            return;
+        }
+
+        http::request<http::string_body> request{http::verb::get, "/" + short_code, 11};
+        send(owner, std::move(request),
+            [callback = std::move(callback)](http::response<http::string_body> response, std::exception_ptr error) {
+                if (error) {
+                    callback(Lookup::Missing, {}, error);
+                } else if (response.result() == http::status::not_found) {
+                    callback(Lookup::Missing, {}, nullptr);
+                } else if (response.result() == http::status::gone) {
+                    callback(Lookup::Expired, {}, nullptr);
+                } else if (http::to_status_class(response.result()) == http::status_class::redirection) {
+                    const auto location = response[http::field::location];
+                    callback(Lookup::Found, std::string(location.data(), location.size()), nullptr);
+                } else if (response.result() == http::status::ok) {
+                    callback(Lookup::Found, std::move(response.body()), nullptr);
+                } else {
+                    callback(Lookup::Missing, {}, peerError(response));
+                }
+            });
+    }
+
+    void getOriginalUrlsAsync(std::vector<std::string> short_codes, BatchResolveCallback callback) override {
+        scatter<BatchResolveCallback>(std::move(short_codes),
+            [this](std::string_view short_code) { return ring_->ownerOfCode(short_code); },
+            [this](std::size_t owner, std::vector<std::string> items, BatchResolveCallback done) {
+                if (owner == self_) {
+                    local_->getOriginalUrlsAsync(std::move(items), std::move(done));
+                    return;
+                }
+                http::request<http::string_body> request{http::verb::post, "/resolve/batch", 11};
+                request.body() = jsonArray(items);
+                request.set(http::field::content_type, "application/json");
+                const std::size_t expected = items.size();
+                send(owner, std::move(request),
+                    [done = std::move(done), expected](http::response<http::string_body> response,
+                                                       std::exception_ptr error) {
+                        done(error ? std::vector<std::string>() : parseResults(response, expected, error), error);
+                    });
+            },
+            std::move(callback));
+    }
+
+private:
+    using PeerCallback = std::function<void(http::response<http::string_body> response, std::exception_ptr error)>;
+
+    std::shared_ptr<const HashRing> ring_;
+    std::size_t self_;
+    std::shared_ptr<Storage> local_;
+    net::io_context ioc_;
+    net::executor_work_guard<net::io_context::executor_type> work_;
+    // Соединения к узлам уничтожаются раньше ioc_
+    std::vector<std::unique_ptr<PeerConnectionPool>> peers_;
+    std::vector<std::thread> threads_;
+
+    void send(std::size_t owner, http::request<http::string_body> request, PeerCallback callback) {
+        PeerConnectionPool& peer = *peers_[owner];
+        request.set(http::field::user_agent, "URLShortener/1.0");
+        std::make_shared<PeerRequest>(peer, std::move(request),
+            [&peer, callback = std::move(callback)](beast::error_code ec, http::response<http::string_body> response) {
+                if (ec) {
+                    callback({}, std::make_exception_ptr(std::runtime_error(
+                        "Cluster node " + peer.address() + " is unavailable: " + ec.message())));
+                    return;
+                }
+                callback(std::move(response), nullptr);
+            })->start();
+    }
+
+    void forwardShorten(std::size_t owner, std::vector<std::string> original_urls, std::int64_t expires_at,
+                        BatchShortenCallback callback) {
+        http::request<http::string_body> request{http::verb::post, "/makeshort/batch", 11};
+        request.body() = jsonArray(original_urls);
+        request.set(http::field::content_type, "application/json");
+        // Срок передаётся абсолютным: X-Link-TTL отсчитывался бы от времени прихода
+        if (expires_at != 0) {
+            request.set(LINK_EXPIRES_AT_HEADER, std::to_string(expires_at));
+        }
+        const std::size_t expected = original_urls.size();
+        send(owner, std::move(request),
+            [callback = std::move(callback), expected](http::response<http::string_body> response,
+                                                       std::exception_ptr error) {
+                std::vector<std::string> short_codes;
+                if (!error) {
+                    short_codes = parseResults(response, expected, error);
+                }
+                // Узел отвечает полными короткими ссылками, нужен только код
+                for (auto& short_code : short_codes) {
+                    short_code.erase(0, short_code.rfind('/') + 1);
+                }
+                callback(std::move(short_codes), error);
+            });
+    }
+
+    // Делит items по владельцам, отправляет части и собирает ответы в
+    // исходном порядке. Ошибка любой части — ошибка всего вызова.
+    template <typename Callback, typename OwnerOf, typename Dispatch>
+    void scatter(std::vector<std::string> items, OwnerOf owner_of, Dispatch dispatch, Callback callback) {
+        struct Gather {
+            std::mutex mutex;
+            std::vector<std::string> results;
+            std::size_t remaining = 0;
+            std::exception_ptr error;
+            Callback callback;
+        };
+
+        std::vector<std::vector<std::size_t>> positions(peers_.size());
+        for (std::size_t i = 0; i < items.size(); ++i) {
+            positions[owner_of(items[i])].push_back(i);
+        }
+
+        auto gather = std::make_shared<Gather>();
+        gather->results.resize(items.size());
+        gather->callback = std::move(callback);
+        for (const auto& part : positions) {
+            gather->remaining += part.empty() ? 0 : 1;
+        }
+        if (gather->remaining == 0) {
+            gather->callback({}, nullptr);
+            return;
+        }
+
+        for (std::size_t owner = 0; owner < positions.size(); ++owner) {
+            if (positions[owner].empty()) {
+                continue;
+            }
+            std::vector<std::string> part;
+            part.reserve(positions[owner].size());
+            for (std::size_t i : positions[owner]) {
+                part.push_back(items[i]);
+            }
+            dispatch(owner, std::move(part),
+                [gather, indices = std::move(positions[owner])](std::vector<std::string> results,
+                                                                std::exception_ptr error) {
+                    std::unique_lock<std::mutex> lock(gather->mutex);
+                    if (error) {
+                        gather->error = gather->error ? gather->error : error;
+                    } else {
+                        for (std::size_t i = 0; i < indices.size() && i < results.size(); ++i) {
+                            gather->results[indices[i]] = std::move(results[i]);
+                        }
+                    }
+                    if (--gather->remaining > 0) {
+                        return;
+                    }
+                    lock.unlock();
+                    if (gather->error) {
+                        gather->callback({}, gather->error);
+                    } else {
+                        gather->callback(std::move(gather->results), nullptr);
+                    }
+                });
+        }
+    }
+
+    static std::string jsonArray(const std::vector<std::string>& items) {
+        const BatchFormat json(true);
+        std::string body;
+        json.begin(body);
+        for (std::size_t i = 0; i < items.size(); ++i) {
+            json.append(body, &items[i], i == 0);
+        }
+        json.end(body);
+        return body;
+    }
+
+    static std::vector<std::string> parseResults(const http::response<http::string_body>& response,
+                                                 std::size_t expected, std::exception_ptr& error) {
+        if (response.result() != http::status::ok) {
+            error = peerError(response);
+            return {};
+        }
+        try {
+            auto results = BatchFormat(true).parseResults(response.body());
+            if (results.size() == expected) {
+                return results;
+            }
+            error = std::make_exception_ptr(std::runtime_error("Cluster node returned a partial batch"));
+        } catch (...) {
+            error = std::current_exception();
+        }
+        return {};
+    }
+
+    static std::exception_ptr peerError(const http::response<http::string_body>& response) {
+        if (response.result() == http::status::service_unavailable) {
+            return std::make_exception_ptr(OverloadedError("Cluster node is overloaded: " + response.body()));
+        }
+        return std::make_exception_ptr(std::runtime_error(
+            "Cluster node answered " + std::to_string(response.result_int()) + ": " + response.body()));
+    }
+};
+
+// Журнал репликации — строки urls в порядке id первичного узла.
+// Реплика присылает рукопожатие [8 байт REPLICATION_MAGIC][u64 id последней
+// применённой записи], первичный узел отвечает потоком кадров
+// [u32 длина][i64 id][i64 expires_at][u8 длина кода][код][URL]. Кадр нулевой
+// длины означает «журнал передан до конца» и служит heartbeat'ом. Числа —
+// little-endian. Удаления не передаются: реплика сама чистит истёкшие ссылки.
+constexpr char REPLICATION_MAGIC[8] = {'U', 'R', 'L', 'R', 'E', 'P', 'L', '2'};
+// Защита от мусора в потоке: кадр не может быть больше кода и URL
+constexpr std::uint32_t REPLICATION_MAX_FRAME = 1 << 24;
+
+void appendLittleEndian(std::string& out, std::uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        out += static_cast<char>((value >> (8 * i)) & 0xFF);
+    }
+}
+
+std::uint64_t readLittleEndian(const char* data, int bytes) {
+    std::uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value |= std::uint64_t{static_cast<unsigned char>(data[i])} << (8 * i);
+    }
+    return value;
+}
+
+void appendReplicationFrame(std::string& out, const ReplicatedUrl& row) {
+    appendLittleEndian(out, 8 + 8 + 1 + row.short_code.size() + row.original_url.size(), 4);
+    appendLittleEndian(out, static_cast<std::uint64_t>(row.id), 8);
+    appendLittleEndian(out, static_cast<std::uint64_t>(row.expires_at), 8);
+    appendLittleEndian(out, row.short_code.size(), 1);
+    out += row.short_code;
+    out += row.original_url;
+}
+
+ReplicatedUrl parseReplicationFrame(std::string_view payload) {
+    if (payload.size() < 17) {
+        throw std::invalid_argument("Malformed replication frame");
+    }
+    const std::size_t code_length = static_cast<unsigned char>(payload[16]);
+    if (payload.size() < 17 + code_length) {
+        throw std::invalid_argument("Malformed replication frame");
+    }
+    ReplicatedUrl row;
+    row.id = static_cast<std::int64_t>(readLittleEndian(payload.data(), 8));
+    row.expires_at = static_cast<std::int64_t>(readLittleEndian(payload.data() + 8, 8));
+    row.short_code.assign(payload.substr(17, code_length));
+    row.original_url.assign(payload.substr(17 + code_length));
+    return row;
+}
+
+// Отдаёт журнал одной реплике: дочитывает его порциями по replication_batch,
+// затем опрашивает базу раз в replication_poll_interval — это и есть
+// граница отставания реплики
+class ReplicationPublisher : public std::enable_shared_from_this<ReplicationPublisher> {
+public:
+    ReplicationPublisher(tcp::socket socket, ReadConnection& reader)
+        : stream_(std::move(socket))
+        , timer_(stream_.get_executor())
+        , reader_(reader) {}
+
+    void start() {
+        stream_.expires_after(Config::current().replication_heartbeat * 3);
+        auto self = shared_from_this();
+        net::async_read(stream_, net::buffer(handshake_), [self](beast::error_code ec, std::size_t) {
+            if (ec || std::memcmp(self->handshake_.data(), REPLICATION_MAGIC, sizeof(REPLICATION_MAGIC)) != 0) {
+                return;
+            }
+            self->position_ = static_cast<std::int64_t>(
+                readLittleEndian(self->handshake_.data() + sizeof(REPLICATION_MAGIC), 8));
+            self->publish();
+        });
+    }
+
+private:
+    beast::tcp_stream stream_;
+    net::steady_timer timer_;
+    ReadConnection& reader_;
+    std::array<char, sizeof(REPLICATION_MAGIC) + 8> handshake_{};
+    std::int64_t position_ = 0;
+    std::vector<ReplicatedUrl> rows_;
+    std::string out_;
+    std::chrono::steady_clock::time_point last_write_{};
+
+    void publish() {
+        try {
+            reader_.urlsSince(position_, Config::current().replication_batch, rows_);
+        } catch (const std::exception& e) {
+            std::cerr << "Replication: cannot read log: " << e.what() << std::endl;
+            return;
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (rows_.empty() && now - last_write_ < Config::current().replication_heartbeat) {
+            wait();
+            return;
+        }
+
+        out_.clear();
+        for (const auto& row : rows_) {
+            appendReplicationFrame(out_, row);
+            position_ = row.id;
+        }
+        appendLittleEndian(out_, 0, 4);
+        last_write_ = now;
+
+        const bool caught_up = rows_.size() < static_cast<std::size_t>(Config::current().replication_batch);
+        stream_.expires_after(Config::current().replication_heartbeat * 3);
+        auto self = shared_from_this();
+        net::async_write(stream_, net::buffer(out_), [self, caught_up](beast::error_code ec, std::size_t) {
+            if (ec) {
+                return;
+            }
+            if (caught_up) {
+                self->wait();
+            } else {
+                self->publish();
+            }
+        });
+    }
+
+    void wait() {
+        timer_.expires_after(Config::current().replication_poll_interval);
+        auto self = shared_from_this();
+        timer_.async_wait([self](beast::error_code ec) {
+            if (!ec) {
+                self->publish();
+            }
+        });
+    }
+};
+
+// Слушатель журнала на первичном узле. Работает в собственном потоке и
+// читает urls через своё соединение, не занимая потоки HTTP.
+class ReplicationServer {
+public:
+    ReplicationServer(const std::string& db_path, const tcp::endpoint& endpoint)
+        : reader_(db_path)
+        , acceptor_(ioc_) {
+        acceptor_.open(endpoint.protocol());
+        acceptor_.set_option(net::socket_base::reuse_address(true));
+        if (endpoint.address().is_v6()) {
+            acceptor_.set_option(net::ip::v6_only(false));
+        }
+        acceptor_.bind(endpoint);
+        acceptor_.listen();
+        accept();
+        thread_ = std::thread([this] { ioc_.run(); });
+    }
+
+    ReplicationServer(const ReplicationServer&) = delete;
+    ReplicationServer& operator=(const ReplicationServer&) = delete;
+
+    ~ReplicationServer() {
+        ioc_.stop();
+        thread_.join();
+    }
+
+private:
+    net::io_context ioc_;
+    ReadConnection reader_;
+    tcp::acceptor acceptor_;
+    std::thread thread_;
+
+    void accept() {
+        acceptor_.async_accept([this](beast::error_code ec, tcp::socket socket) {
+            if (!ec) {
+                std::make_shared<ReplicationPublisher>(std::move(socket), reader_)->start();
+            }
+            accept();
+        });
+    }
+};
+
+// Реплика: держит соединение с первичным узлом, копит кадры до кадра
+// «журнал передан» или до replication_batch строк и применяет их к
+// хранилищу одной пачкой. При обрыве переподключается с последней
+// применённой позиции.
+class ReplicationClient {
+public:
+    ReplicationClient(Storage& storage, const std::string& primary)
+        : storage_(storage)
+        , position_(storage.replicationPosition()) {
+        std::tie(host_, port_) = splitHostPort(primary);
+        connect();
+        thread_ = std::thread([this] { ioc_.run(); });
+    }
+
+    ReplicationClient(const ReplicationClient&) = delete;
+    ReplicationClient& operator=(const ReplicationClient&) = delete;
+
+    ~ReplicationClient() {
+        stop();
+    }
+
+    // После stop обработчики больше не выполняются и хранилище не трогается
+    void stop() {
+        ioc_.stop();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+private:
+    Storage& storage_;
+    std::string host_;
+    std::string port_;
+    net::io_context ioc_;
+    // Пока пачка применяется, у ioc_ нет операций, но run() не должен выходить
+    net::executor_work_guard<net::io_context::executor_type> work_{net::make_work_guard(ioc_)};
+    tcp::resolver resolver_{ioc_};
+    beast::tcp_stream stream_{ioc_};
+    net::steady_timer retry_timer_{ioc_};
+    std::string handshake_;
+    std::array<char, 4> length_{};
+    std::string payload_;
+    std::vector<ReplicatedUrl> batch_;
+    std::int64_t position_;
+    bool connected_ = false;
+    std::thread thread_;
+
+    void connect() {
+        resolver_.async_resolve(host_, port_,
+            [this](beast::error_code ec, tcp::resolver::results_type results) {
+                if (ec) {
+                    retry(ec.message());
+                    return;
+                }
+                stream_.expires_after(Config::current().replication_heartbeat * 3);
+                stream_.async_connect(results, [this](beast::error_code ec, const tcp::endpoint&) {
+                    if (ec) {
+                        retry(ec.message());
+                        return;
+                    }
+                    sendHandshake();
+                });
+            });
+    }
+
+    void sendHandshake() {
+        handshake_.assign(REPLICATION_MAGIC, sizeof(REPLICATION_MAGIC));
+        appendLittleEndian(handshake_, static_cast<std::uint64_t>(position_), 8);
+        net::async_write(stream_, net::buffer(handshake_), [this](beast::error_code ec, std::size_t) {
+            if (ec) {
+                retry(ec.message());
+                return;
+            }
+            connected_ = true;
+            std::cout << "Replication: following " << host_ << ":" << port_
+                      << " from id " << position_ << std::endl;
+            readFrame();
+        });
+    }
+
+    void readFrame() {
+        stream_.expires_after(Config::current().replication_heartbeat * 3);
+        net::async_read(stream_, net::buffer(length_), [this](beast::error_code ec, std::size_t) {
+            if (ec) {
+                retry(ec.message());
+                return;
+            }
+            const auto length = static_cast<std::uint32_t>(readLittleEndian(length_.data(), 4));
+            if (length == 0) {
+                apply();
+                return;
+            }
+            if (length > REPLICATION_MAX_FRAME) {
+                retry("frame too large");
+                return;
+            }
+            payload_.resize(length);
+            net::async_read(stream_, net::buffer(payload_), [this](beast::error_code ec, std::size_t) {
+                if (ec) {
+                    retry(ec.message());
+                    return;
+                }
+                try {
+                    batch_.push_back(parseReplicationFrame(payload_));
+                } catch (const std::exception& e) {
+                    retry(e.what());
+                    return;
+                }
+                if (batch_.size() >= static_cast<std::size_t>(Config::current().replication_batch)) {
+                    apply();
+                } else {
+                    readFrame();
+                }
+            });
+        });
+    }
+
+    // Пока пачка применяется, поток не читается: первичный узел упирается
+    // в TCP-окно и не обгоняет реплику
+    void apply() {
+        if (batch_.empty()) {
+            readFrame();
+            return;
+        }
+        const std::int64_t last_id = batch_.back().id;
+        std::vector<ReplicatedUrl> rows;
+        rows.swap(batch_);
+        storage_.applyReplicatedAsync(std::move(rows), [this, last_id](std::exception_ptr error) {
+            net::post(ioc_, [this, last_id, error] {
+                if (error) {
+                    try {
+                        std::rethrow_exception(error);
+                    } catch (const std::exception& e) {
+                        retry(e.what());
+                    }
+                    return;
+                }
+                position_ = last_id;
+                readFrame();
+            });
+        });
+    }
+
+    void retry(const std::string& reason) {
+        if (connected_) {
+            std::cerr << "Replication: lost primary " << host_ << ":" << port_ << ": " << reason << std::endl;
+            connected_ = false;
+        }
+        stream_.close();
+        batch_.clear();
+        retry_timer_.expires_after(Config::current().replication_reconnect_delay);
+        retry_timer_.async_wait([this](beast::error_code ec) {
+            if (!ec) {
+                connect();
+            }
+        });
+    }
+};
+
+// Read-only реплика: читает из локального хранилища, которое наполняет
+// ReplicationClient; сокращение отклоняется
+class ReplicaStorage : public Storage {
+public:
+    ReplicaStorage(std::shared_ptr<Storage> local, const std::string& primary)
+        : local_(std::move(local))
+        , client_(std::make_unique<ReplicationClient>(*local_, primary)) {}
+
+    ~ReplicaStorage() override {
+        // Сначала останавливаем клиента, затем дожидаемся записей хранилища:
+        // их колбэки ставятся в уже остановленный io_context клиента
+        client_->stop();
+        local_.reset();
+    }
+
+    void shortenUrlAsync(std::string, std::int64_t, ShortenCallback callback) override {
+        callback({}, readOnlyError());
+    }
+
+    void shortenUrlsAsync(std::vector<std::string>, std::int64_t, BatchShortenCallback callback) override {
+        callback({}, readOnlyError());
+    }
+
+    // Журнал несёт только urls: переходы реплика считает в своей базе
+    bool recordsClicks() const override { return local_->recordsClicks(); }
+
+    void recordClicksAsync(std::vector<ClickCount> clicks, ApplyCallback callback) override {
+        local_->recordClicksAsync(std::move(clicks), std::move(callback));
+    }
+
+    bool ready() const override { return local_->ready(); }
+
+    void saveHotSet() override { local_->saveHotSet(); }
+
+    std::optional<Lookup> tryGetOriginalUrl(const std::string& short_code, std::string& original_url) override {
+        return local_->tryGetOriginalUrl(short_code, original_url);
+    }
+
+    void getOriginalUrlAsync(std::string short_code, ResolveCallback callback) override {
+        local_->getOriginalUrlAsync(std::move(short_code), std::move(callback));
+    }
+
+    void getOriginalUrlsAsync(std::vector<std::string> short_codes, BatchResolveCallback callback) override {
+        local_->getOriginalUrlsAsync(std::move(short_codes), std::move(callback));
+    }
+
+private:
+    std::shared_ptr<Storage> local_;
+    std::unique_ptr<ReplicationClient> client_;
+
+    static std::exception_ptr readOnlyError() {
+        return std::make_exception_ptr(std::runtime_error("Storage is a read-only replica"));
+    }
+};
+
+std::shared_ptr<Storage> makeStorage() {
+    std::shared_ptr<const HashRing> ring;
+    std::string code_prefix;
+    const Config& config = Config::current();
+    if (!config.cluster_nodes.empty()) {
+        ring = std::make_shared<HashRing>(config.cluster_nodes);
+        code_prefix = clusterCodePrefix(config.cluster_self);
+    }
+
+    std::shared_ptr<Storage> local;
+    switch (config.storage_engine) {
+    case StorageEngine::Memory:
+        local = std::make_shared<MemoryStorage>(0, code_prefix);
+        break;
+    case StorageEngine::Snapshot:
+        local = std::make_shared<SnapshotStorage>();
+        break;
+    case StorageEngine::Sqlite:
+        local = std::make_shared<SqliteStorage>(config.db_path, code_prefix);
+        break;
+    }
+    if (!config.replication_primary.empty()) {
+        local = std::make_shared<ReplicaStorage>(std::move(local), config.replication_primary);
+    }
+
+    if (!ring) {
+        return local;
+    }
+    return std::make_shared<ClusterStorage>(ring, config.cluster_self, config.cluster_nodes, std::move(local));
+}
+
+struct ClickEvent {
+    std::array<char, MAX_SHORT_CODE_LENGTH> code;
+    std::uint8_t referrer_length;
+    std::array<char, CLICK_REFERRER_MAX> referrer;
+};
+
+// Кольцевой буфер с одним писателем (поток ввода-вывода) и одним читателем
+// (агрегатор), без блокировок. В полный буфер событие не пишется.
+class ClickRing {
+public:
+    bool push(const ClickEvent& event) {
+        const std::size_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) == CLICK_RING_CAPACITY) {
+            return false;
+        }
+        events_[head & (CLICK_RING_CAPACITY - 1)] = event;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    template <typename Consume>
+    void drain(Consume&& consume) {
+        const std::size_t tail = tail_.load(std::memory_order_relaxed);
+        const std::size_t head = head_.load(std::memory_order_acquire);
+        for (std::size_t i = tail; i != head; ++i) {
+            consume(events_[i & (CLICK_RING_CAPACITY - 1)]);
+        }
+        tail_.store(head, std::memory_order_release);
+    }
+
+private:
+    static_assert((CLICK_RING_CAPACITY & (CLICK_RING_CAPACITY - 1)) == 0, "CLICK_RING_CAPACITY must be a power of two");
+
+    alignas(64) std::atomic<std::size_t> head_{0};
+    alignas(64) std::atomic<std::size_t> tail_{0};
+    std::array<ClickEvent, CLICK_RING_CAPACITY> events_;
+};
+
+// Учёт переходов: сессии пишут события в кольцо своего потока, агрегатор
+// раз в click_drain_interval складывает их в счётчики (code, referrer) и раз
+// в click_flush_interval сбрасывает в хранилище одной транзакцией. Запросы
+// никогда не ждут: при переполнении событие отбрасывается и учитывается в Metrics.
+class ClickPipeline {
+public:
+    explicit ClickPipeline(std::shared_ptr<Storage> storage)
+        : storage_(std::move(storage))
+        , id_(nextId())
+        , thread_([this] { run(); }) {}
+
+    ClickPipeline(const ClickPipeline&) = delete;
+    ClickPipeline& operator=(const ClickPipeline&) = delete;
+
+    // Накопленное перед остановкой сбрасывается последней транзакцией
+    ~ClickPipeline() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wakeup_.notify_one();
+        thread_.join();
+    }
+
+    void record(std::string_view short_code, std::string_view referrer) {
+        if (short_code.size() != code_length_) {
+            return;
+        }
+        ClickEvent event;
+        std::memcpy(event.code.data(), short_code.data(), code_length_);
+        referrer = referrerHost(referrer).substr(0, CLICK_REFERRER_MAX);
+        event.referrer_length = static_cast<std::uint8_t>(referrer.size());
+        std::memcpy(event.referrer.data(), referrer.data(), referrer.size());
+
+        if (localRing().push(event)) {
+            Metrics::instance().clickRecorded();
+        } else {
+            Metrics::instance().clickDropped();
+        }
+    }
+
+    // "https://t.co/abc?x" -> "t.co"; статистика ведётся по сайтам, а не страницам
+    static std::string_view referrerHost(std::string_view referrer) {
+        const auto scheme = referrer.find("://");
+        if (scheme != std::string_view::npos) {
+            referrer.remove_prefix(scheme + 3);
+        }
+        return referrer.substr(0, referrer.find_first_of("/?#"));
+    }
+
+private:
+    std::shared_ptr<Storage> storage_;
+    const std::uint64_t id_;
+    const std::size_t code_length_ = static_cast<std::size_t>(Config::current().short_code_length);
+    std::mutex rings_mutex_;
+    std::vector<std::unique_ptr<ClickRing>> rings_;
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    bool stopping_ = false;
+    // Ключ — код фиксированной длины, сразу за ним referrer
+    std::unordered_map<std::string, std::uint64_t> pending_;
+    std::string key_;
+    std::thread thread_;
+
+    static std::uint64_t nextId() {
+        static std::atomic<std::uint64_t> next{1};
+        return next.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    ClickRing& localRing() {
+        thread_local std::uint64_t owner = 0;
+        thread_local ClickRing* ring = nullptr;
+        if (owner != id_) {
+            std::lock_guard<std::mutex> lock(rings_mutex_);
+            rings_.push_back(std::make_unique<ClickRing>());
+            ring = rings_.back().get();
+            owner = id_;
+        }
+        return *ring;
+    }
+
+    void run() {
+        auto next_flush = std::chrono::steady_clock::now() + Config::current().click_flush_interval;
+        for (;;) {
+            bool stopping;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wakeup_.wait_for(lock, Config::current().click_drain_interval, [this] { return stopping_; });
+                stopping = stopping_;
+            }
+            drain();
+            const auto now = std::chrono::steady_clock::now();
+            if (stopping || now >= next_flush) {
+                flush();
+                next_flush = now + Config::current().click_flush_interval;
+            }
+            if (stopping) {
+                return;
+            }
+        }
+    }
+
+    void drain() {
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        for (auto& ring : rings_) {
+            ring->drain([this](const ClickEvent& event) {
+                key_.assign(event.code.data(), code_length_);
+                key_.append(event.referrer.data(), event.referrer_length);
+                const auto it = pending_.find(key_);
+                if (it != pending_.end()) {
+                    ++it->second;
+                } else if (pending_.size() < Config::current().click_max_pending_keys) {
+                    pending_.emplace(key_, 1);
+                } else {
+                    Metrics::instance().clickDropped();
+                }
+            });
+        }
+    }
+
+    // При ошибке счётчики остаются в pending_ и уходят со следующим сбросом
+    void flush() {
+        if (pending_.empty()) {
+            return;
+        }
+        std::vector<ClickCount> counts;
+        counts.reserve(pending_.size());
+        for (const auto& [key, count] : pending_) {
+            counts.push_back({key.substr(0, code_length_), key.substr(code_length_), count});
+        }
+
+        std::promise<void> done;
+        storage_->recordClicksAsync(std::move(counts), [&done](std::exception_ptr error) {
+            if (error) {
+                done.set_exception(error);
+            } else {
+                done.set_value();
+            }
+        });
+        try {
+            done.get_future().get();
+            pending_.clear();
+        } catch (const std::exception& e) {
+            std::cerr << "Clicks: flush failed: " << e.what() << std::endl;
+        }
+    }
+};
+
+// ::ffff:1.2.3.4 и 1.2.3.4 — один и тот же клиент
+net::ip::address normalizeAddress(const net::ip::address& address) {
+    if (address.is_v6() && address.to_v6().is_v4_mapped()) {
+        return net::ip::make_address_v4(net::ip::v4_mapped, address.to_v6());
+    }
+    return address;
+}
+
+// Адреса узлов из cluster_nodes. X-Cluster-Forwarded принимается только от
+// них: иначе любой клиент обходил бы маршрутизацию по узлам и лимит частоты.
+class ClusterPeers {
+public:
+    ClusterPeers() : addresses_(resolve()) {}
+
+    bool contains(const net::ip::address& address) const {
+        return std::find(addresses_.begin(), addresses_.end(), address) != addresses_.end();
+    }
+
+private:
+    std::vector<net::ip::address> addresses_;
+
+    static std::vector<net::ip::address> resolve() {
+        std::vector<net::ip::address> addresses;
+        net::io_context ioc;
+        tcp::resolver resolver(ioc);
+        for (const auto& node : Config::current().cluster_nodes) {
+            const auto [host, port] = splitHostPort(node);
+            beast::error_code ec;
+            for (const auto& entry : resolver.resolve(host, port, ec)) {
+                addresses.push_back(normalizeAddress(entry.endpoint().address()));
+            }
+        }
+        return addresses;
+    }
+};
+
+// Token bucket на пару (клиент, маршрут) в таблице фиксированного размера:
+// rate_limit_shards шардов по rate_limit_slots_per_shard корзин, у каждого шарда
+// свой мьютекс. Новый клиент занимает свободную корзину в окне из
+// RATE_LIMIT_PROBE слотов или вытесняет ту, что дольше всех не обновлялась.
+class RateLimiter {
+public:
+    RateLimiter()
+        : shard_count_(Config::current().rate_limit_shards)
+        , slots_per_shard_(Config::current().rate_limit_slots_per_shard)
+        , shards_(std::make_unique<Shard[]>(shard_count_)) {
+        for (std::size_t i = 0; i < shard_count_; ++i) {
+            shards_[i].buckets.resize(slots_per_shard_);
+        }
+    }
+
+    bool allow(std::uint64_t client, Route route) {
+        const RateLimit limit = rateLimitFor(route);
+        if (limit.per_second <= 0) {
+            return true;
+        }
+
+        // Ключ 0 означает свободную корзину
+        const std::uint64_t key = mix64(client + static_cast<std::uint64_t>(route) + 1) | 1;
+        Shard& shard = shards_[key % shard_count_];
+        const std::int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        Bucket* bucket = nullptr;
+        Bucket* empty = nullptr;
+        Bucket* oldest = nullptr;
+        const std::size_t start = (key >> 32) % slots_per_shard_;
+        for (std::size_t i = 0; i < RATE_LIMIT_PROBE && !bucket; ++i) {
+            Bucket& candidate = shard.buckets[(start + i) % slots_per_shard_];
+            if (candidate.key == key) {
+                bucket = &candidate;
+            } else if (candidate.key == 0) {
+                empty = empty ? empty : &candidate;
+            } else if (!oldest || candidate.updated_ns < oldest->updated_ns) {
+                oldest = &candidate;
+            }
+        }
+        if (!bucket) {
+            bucket = empty ? empty : oldest;
+            bucket->key = key;
+            bucket->tokens = static_cast<float>(limit.burst);
+            bucket->updated_ns = now;
+        }
+
+        const double elapsed = static_cast<double>(now - bucket->updated_ns) / 1e9;
+        bucket->tokens = static_cast<float>(std::min(limit.burst, bucket->tokens + elapsed * limit.per_second));
+        bucket->updated_ns = now;
+        if (bucket->tokens < 1.0f) {
+            return false;
+        }
+        bucket->tokens -= 1.0f;
+        return true;
+    }
+
+    static std::uint64_t addressKey(const net::ip::address& address) {
+        if (address.is_v4()) {
+            return mix64(address.to_v4().to_uint());
+        }
+        const auto bytes = address.to_v6().to_bytes();
+        return mix64(fnv1a64(std::string_view(reinterpret_cast<const char*>(bytes.data()), bytes.size())));
+    }
+
+private:
+    struct Bucket {
+        std::uint64_t key = 0;
+        float tokens = 0;
+        std::int64_t updated_ns = 0;
+    };
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::vector<Bucket> buckets;
+    };
+
+    const std::size_t shard_count_;
+    const std::size_t slots_per_shard_;
+    std::unique_ptr<Shard[]> shards_;
+};
+
+// Ограничение числа одновременных сессий. Место занято, пока жив талон;
+// счётчик разделяют все талоны, так что сессия может пережить Server.
+class AdmissionControl {
+public:
+    class Ticket {
+    public:
+        Ticket() = default;
+        explicit Ticket(std::shared_ptr<std::atomic<std::size_t>> active) : active_(std::move(active)) {}
+        Ticket(Ticket&&) = default;
+        Ticket& operator=(Ticket&&) = default;
+
+        ~Ticket() {
+            if (active_) {
+                active_->fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+
+    private:
+        std::shared_ptr<std::atomic<std::size_t>> active_;
+    };
+
+    AdmissionControl()
+        : active_(std::make_shared<std::atomic<std::size_t>>(0)) {}
+
+    std::optional<Ticket> tryAdmit() {
+        if (active_->fetch_add(1, std::memory_order_relaxed) >= Config::current().max_sessions) {
+            active_->fetch_sub(1, std::memory_order_relaxed);
+            return std::nullopt;
+        }
+        return Ticket(active_);
+    }
+
+private:
+    std::shared_ptr<std::atomic<std::size_t>> active_;
+};
+
+// Монотонная арена для полей HTTP-ответа сессии: выделение — сдвиг
+// указателя во встроенном буфере, освобождение только уменьшает счётчик
+// живых блоков. Когда освобождены все блоки (поля ответа очищены), арена
+// снова пуста. Не поместившиеся блоки берутся из обычной кучи.
+class FieldArena {
+public:
+    FieldArena() = default;
+    FieldArena(const FieldArena&) = delete;
+    FieldArena& operator=(const FieldArena&) = delete;
+
+    void* allocate(std::size_t bytes, std::size_t alignment) {
+        const std::size_t offset = (used_ + alignment - 1) & ~(alignment - 1);
+        if (offset + bytes > storage_.size()) {
+            return ::operator new(bytes);
+        }
+        used_ = offset + bytes;
+        ++live_;
+        return storage_.data() + offset;
+    }
+
+    void deallocate(void* pointer) noexcept {
+        auto* bytes = static_cast<unsigned char*>(pointer);
+        if (bytes < storage_.data() || bytes >= storage_.data() + storage_.size()) {
+            ::operator delete(pointer);
+            return;
+        }
+        if (--live_ == 0) {
+            used_ = 0;
+        }
+    }
+
+private:
+    alignas(std::max_align_t) std::array<unsigned char, 2048> storage_;
+    std::size_t used_ = 0;
+    std::size_t live_ = 0;
+};
+
+template <typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+
+    explicit ArenaAllocator(FieldArena* arena) noexcept : arena_(arena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept : arena_(other.arena()) {}
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* pointer, std::size_t) noexcept {
+        arena_->deallocate(pointer);
+    }
+
+    FieldArena* arena() const noexcept { return arena_; }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const noexcept { return arena_ == other.arena(); }
+
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const noexcept { return arena_ != other.arena(); }
+
+private:
+    FieldArena* arena_;
+};
+
+using ArenaFields = http::basic_fields<ArenaAllocator<char>>;
+
+// Кэш освобождённых блоков памяти на поток: сессии и их буферы после закрытия
+// соединения возвращаются сюда и достаются следующим соединениям без
+// обращения к куче. Размер кэша ограничен session_pool_per_thread.
+template <typename T>
+class ThreadLocalPool {
+public:
+    static std::unique_ptr<T> take() {
+        auto& items = cache().items;
+        if (items.empty()) {
+            return nullptr;
+        }
+        auto item = std::move(items.back());
+        items.pop_back();
+        return item;
+    }
+
+    static void give(std::unique_ptr<T> item) {
+        auto& items = cache().items;
+        if (items.size() < Config::current().session_pool_per_thread) {
+            items.push_back(std::move(item));
+        }
+    }
+
+private:
+    struct Cache {
+        std::vector<std::unique_ptr<T>> items;
+    };
+
+    static Cache& cache() {
+        thread_local Cache cache;
+        return cache;
+    }
+};
+
+// Аллокатор для std::allocate_shared<Session>: блок с объектом и счётчиком
+// ссылок берётся из потокового кэша
+template <typename T>
+class RecyclingAllocator {
+public:
+    using value_type = T;
+
+    RecyclingAllocator() noexcept = default;
+
+    template <typename U>
+    RecyclingAllocator(const RecyclingAllocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n) {
+        if (n == 1) {
+            if (auto block = ThreadLocalPool<Block>::take()) {
+                return reinterpret_cast<T*>(block.release());
+            }
+            return reinterpret_cast<T*>(new Block);
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* pointer, std::size_t n) noexcept {
+        if (n == 1) {
+            ThreadLocalPool<Block>::give(std::unique_ptr<Block>(reinterpret_cast<Block*>(pointer)));
+            return;
+        }
+        ::operator delete(pointer);
+    }
+
+    template <typename U>
+    bool operator==(const RecyclingAllocator<U>&) const noexcept { return true; }
+
+    template <typename U>
+    bool operator!=(const RecyclingAllocator<U>&) const noexcept { return false; }
+
+private:
+    struct Block {
+        alignas(T) unsigned char bytes[sizeof(T)];
+    };
+};
+
+// Память для состояний асинхронных операций одной сессии. Операции сессии
+// идут по очереди, поэтому одновременно живы лишь несколько блоков
+// (составная операция Beast и операция сокета под ней).
+class HandlerMemory {
+public:
+    HandlerMemory() = default;
+    HandlerMemory(const HandlerMemory&) = delete;
+    HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+    void* allocate(std::size_t size) {
+        if (size <= BLOCK_SIZE) {
+            for (std::size_t i = 0; i < BLOCK_COUNT; ++i) {
+                if (!used_[i]) {
+                    used_[i] = true;
+                    return blocks_[i].bytes;
+                }
+            }
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void* pointer) noexcept {
+        for (std::size_t i = 0; i < BLOCK_COUNT; ++i) {
+            if (pointer == blocks_[i].bytes) {
+                used_[i] = false;
+                return;
+            }
+        }
+        ::operator delete(pointer);
+    }
+
+private:
+    static constexpr std::size_t BLOCK_SIZE = 1024;
+    static constexpr std::size_t BLOCK_COUNT = 6;
+
+    struct Block {
+        alignas(std::max_align_t) unsigned char bytes[BLOCK_SIZE];
+    };
+
+    std::array<Block, BLOCK_COUNT> blocks_;
+    std::array<bool, BLOCK_COUNT> used_{};
+};
+
+template <typename T>
+class HandlerAllocator {
+public:
+    using value_type = T;
+
+    explicit HandlerAllocator(HandlerMemory& memory) noexcept : memory_(&memory) {}
+
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U>& other) noexcept : memory_(other.memory()) {}
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(memory_->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* pointer, std::size_t) noexcept {
+        memory_->deallocate(pointer);
+    }
+
+    HandlerMemory* memory() const noexcept { return memory_; }
+
+    template <typename U>
+    bool operator==(const HandlerAllocator<U>& other) const noexcept { return memory_ == other.memory(); }
+
+    template <typename U>
+    bool operator!=(const HandlerAllocator<U>& other) const noexcept { return memory_ != other.memory(); }
+
+private:
+    HandlerMemory* memory_;
+};
+
+// Обработчик, через associated_allocator направляющий выделения Asio/Beast
+// в HandlerMemory сессии
+template <typename Handler>
+class RecyclingHandler {
+public:
+    using allocator_type = HandlerAllocator<Handler>;
+
+    RecyclingHandler(HandlerMemory& memory, Handler handler)
+        : memory_(memory), handler_(std::move(handler)) {}
+
+    allocator_type get_allocator() const noexcept {
+        return allocator_type(memory_);
+    }
+
+    template <typename... Args>
+    void operator()(Args&&... args) {
+        handler_(std::forward<Args>(args)...);
+    }
+
+private:
+    HandlerMemory& memory_;
+    Handler handler_;
+};
+
+using SessionExecutor = net::strand<net::io_context::executor_type>;
+using SessionSocket = net::basic_stream_socket<tcp, SessionExecutor>;
+// Конкретный тип исполнителя вместо any_io_executor: копии исполнителя
+// в каждой операции не уходят в кучу
+using SessionStream = beast::basic_stream<tcp, SessionExecutor>;
+using SessionRequest = http::request<http::string_body, ArenaFields>;
+using SessionResponse = http::response<http::string_body, ArenaFields>;
+using SessionParser = http::request_parser<http::string_body, ArenaAllocator<char>>;
+
+// Всё, что сессия выделяет под запросы. После закрытия соединения
+// возвращается в ThreadLocalPool вместе с накопленной ёмкостью буферов.
+struct SessionBuffers {
+    FieldArena request_arena;
+    FieldArena response_arena;
+    HandlerMemory handler_memory;
+    beast::flat_buffer buffer;
+    SessionRequest request{std::piecewise_construct, std::make_tuple(),
+                           std::make_tuple(ArenaAllocator<char>(&request_arena))};
+    SessionResponse response{std::piecewise_construct, std::make_tuple(),
+                             std::make_tuple(ArenaAllocator<char>(&response_arena))};
+    std::string url_buffer;
+
+    static std::unique_ptr<SessionBuffers> acquire() {
+        if (auto buffers = ThreadLocalPool<SessionBuffers>::take()) {
+            return buffers;
+        }
+        return std::make_unique<SessionBuffers>();
+    }
+
+    static void release(std::unique_ptr<SessionBuffers> buffers) {
+        buffers->request.clear();
+        buffers->response.clear();
+        buffers->buffer.clear();
+        // Не держим в пуле буферы, раздутые крупными пакетными запросами
+        if (buffers->buffer.capacity() > Config::current().session_buffer_keep_bytes) {
+            buffers->buffer.shrink_to_fit();
+        }
+        for (std::string* body : {&buffers->request.body(), &buffers->response.body(), &buffers->url_buffer}) {
+            if (body->capacity() > Config::current().session_buffer_keep_bytes) {
+                std::string().swap(*body);
+            } else {
+                body->clear();
+            }
+        }
+        ThreadLocalPool<SessionBuffers>::give(std::move(buffers));
+    }
+};
+
+class Session : public std::enable_shared_from_this<Session> {
+public:
+    Session(SessionSocket socket, std::shared_ptr<Storage> storage, ClickPipeline* clicks,
+            RateLimiter* limiter, const ClusterPeers& peers, AdmissionControl::Ticket admission)
+        : stream_(std::move(socket))
+        , storage_(std::move(storage))
+        , clicks_(clicks)
+        , limiter_(limiter)
+        , peers_(peers)
+        , admission_(std::move(admission))
+        , buffers_(SessionBuffers::acquire())
+        , buffer_(buffers_->buffer)
+        , request_(buffers_->request)
+        , response_(buffers_->response)
+        , url_buffer_(buffers_->url_buffer)
+        , handler_memory_(buffers_->handler_memory) {
+        beast::error_code ec;
+        const auto endpoint = stream_.socket().remote_endpoint(ec);
+        if (!ec) {
+            remote_ = normalizeAddress(endpoint.address());
+        }
+        Metrics::instance().sessionOpened();
+    }
+
+    ~Session() {
+        // Недочитанный запрос возвращает поля и тело в буферы до их возврата в пул
+        if (parser_) {
+            request_ = parser_->release();
+            parser_.reset();
+        }
+        SessionBuffers::release(std::move(buffers_));
+        Metrics::instance().sessionClosed();
+    }
+
+    void start() {
+        readRequest();
+    }
+
+private:
+    SessionStream stream_;
+    std::shared_ptr<Storage> storage_;
+    // nullptr — учёт переходов выключен
+    ClickPipeline* clicks_;
+    // nullptr — без ограничения частоты запросов
+    RateLimiter* limiter_;
+    const ClusterPeers& peers_;
+    AdmissionControl::Ticket admission_;
+    net::ip::address remote_;
+    // Текущий запрос переслан узлом кластера
+    bool forwarded_ = false;
+    // Маршрут и время начала текущего запроса — для гистограмм задержки
+    Route route_ = Route::BadRequest;
+    std::chrono::steady_clock::time_point started_;
+    // Переиспользуются между запросами и, через пул, между соединениями
+    std::unique_ptr<SessionBuffers> buffers_;
+    // Не очищается между запросами: в нём остаются байты конвейерных запросов
+    beast::flat_buffer& buffer_;
+    SessionRequest& request_;
+    SessionResponse& response_;
+    std::string& url_buffer_;
+    HandlerMemory& handler_memory_;
+    // Парсер не переиспользуется: создаётся на каждый запрос вокруг request_,
+    // забирая его поля и тело вместе с памятью, и отдаёт их обратно
+    std::optional<SessionParser> parser_;
+
+    // Запрос, пересланный другим узлом кластера, обслуживается локально
+    Storage& storage() {
+        if (forwarded_) {
+            return storage_->local();
+        }
+        return *storage_;
+    }
+
+    // nullopt — клиент не ограничивается: локальный прокси (фронтенд) без
+    // X-Forwarded-For или узел кластера, переславший уже проверенный запрос.
+    // За локальным прокси клиент — последний адрес X-Forwarded-For: его
+    // дописывает сам прокси, а предыдущие присылает клиент.
+    std::optional<std::uint64_t> clientKey() const {
+        if (remote_.is_loopback()) {
+            const auto header = request_["X-Forwarded-For"];
+            std::string_view forwarded(header.data(), header.size());
+            forwarded = forwarded.substr(forwarded.rfind(',') + 1);
+            const auto first = forwarded.find_first_not_of(' ');
+            if (first == std::string_view::npos) {
+                return std::nullopt;
+            }
+            forwarded = forwarded.substr(first, forwarded.find_last_not_of(' ') + 1 - first);
+            return mix64(fnv1a64(forwarded));
+        }
+        if (forwarded_) {
+            return std::nullopt;
+        }
+        return RateLimiter::addressKey(remote_);
+    }
+
+    bool rateLimited(Route route) const {
+        if (!limiter_) {
+            return false;
+        }
+        const auto client = clientKey();
+        return client && !limiter_->allow(*client, route);
+    }
+
+    template <typename Handler>
+    RecyclingHandler<Handler> recycling(Handler handler) {
+        return RecyclingHandler<Handler>(handler_memory_, std::move(handler));
+    }
+
+    void readRequest() {
+        // Поля возвращают память в арену, тело сохраняет ёмкость
+        request_.clear();
+        request_.body().clear();
+        parser_.emplace(std::move(request_));
+        parser_->header_limit(Config::current().session_header_limit);
+        parser_->body_limit(Config::current().session_body_limit);
+
+        // Байты конвейерного запроса уже в буфере — ждать первого байта не нужно
+        if (buffer_.size() > 0) {
+            parseBuffered();
+            return;
+        }
 
-class CodeGenerator {
-public:
-    static std::string generate(int length = SHORT_CODE_LENGTH) {
-        static const std::string chars =
-            "abcdefghijklmnopqrstuvwxyz"
-            "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-            "0123456789";
+        stream_.expires_after(Config::current().session_idle_timeout);
+        auto self = shared_from_this();
+        stream_.async_read_some(buffer_.prepare(beast::read_size(buffer_, 65536)), recycling(
+            [self](beast::error_code ec, std::size_t bytes) {
+                if (ec) {
+                    self->readFailed(ec, SessionLimit::IdleTimeout);
+                    return;
+                }
+                self->buffer_.commit(bytes);
+                self->parseBuffered();
+            }));
+    }
 
-        static std::random_device rd;
-        static std::mt19937 gen(rd());
-        static std::uniform_int_distribution<> dist(0, chars. size() - 1);
+    // Обычно весь запрос приходит первым же чтением: разбираем его сразу,
+    // без асинхронной операции чтения заголовка и её отложенного завершения
+    void parseBuffered() {
+        beast::error_code ec;
+        while (!parser_->is_done() && buffer_.size() > 0) {
+            const std::size_t used = parser_->put(buffer_.data(), ec);
+            buffer_.consume(used);
+            if (ec == http::error::need_more) {
+                break;
+            }
+            if (ec) {
+                readFailed(ec, SessionLimit::HeaderTimeout);
+                return;
+            }
+            if (used == 0) {
+                break;
+            }
+        }
 
-        std::string code;
-        code.reserve(length);
-        for (int i = 0; i < length; ++i) {
-            code += chars[dist(gen)];
+        if (parser_->is_done()) {
+            requestRead();
+        } else if (parser_->is_header_done()) {
+            readBody();
+        } else {
+            readHeader();
         }
-        return code;
     }
-};
 
-class Database {
-public:
-    Database(const std::string& db_path = "urls.db")
-        : db_(db_path, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE) {
-        initializeSchema();
+    void readHeader() {
+        stream_.expires_after(Config::current().session_header_timeout);
+        auto self = shared_from_this();
+        http::async_read_header(stream_, buffer_, *parser_, recycling(
+            [self](beast::error_code ec, std::size_t) {
+                if (ec) {
+                    self->readFailed(ec, SessionLimit::HeaderTimeout);
+                    return;
+                }
+                if (self->parser_->is_done()) {
+                    self->requestRead();
+                    return;
+                }
+                self->readBody();
+            }));
     }
 
-    void initializeSchema() {
-        db_.exec(R"(
-            CREATE TABLE IF NOT EXISTS urls (
-                id INTEGER PRIMARY KEY AUTOINCREMENT,
-                short_code TEXT UNIQUE NOT NULL,
-                original_url TEXT NOT NULL,
-                created_at DATETIME DEFAULT CURRENT_TIMESTAMP
-            )
-        )");
-        db_.exec("CREATE INDEX IF NOT EXISTS idx_short_code ON urls(short_code)");
-        db_.exec("CREATE INDEX IF NOT EXISTS idx_original_url ON urls(original_url)");
+    void readBody() {
+        stream_.expires_after(Config::current().session_body_timeout);
+        auto self = shared_from_this();
+        http::async_read(stream_, buffer_, *parser_, recycling(
+            [self](beast::error_code ec, std::size_t) {
+                if (ec) {
+                    self->readFailed(ec, SessionLimit::BodyTimeout);
+                    return;
+                }
+                self->requestRead();
+            }));
+    }
+
+    void requestRead() {
+        request_ = parser_->release();
+        parser_.reset();
+        acceptForwardedHeader();
+        processRequest();
     }
 
-    std::string shortenUrl(const std::string& original_url) {
-        SQLite::Statement query(db_, "SELECT short_code FROM urls WHERE original_url = ? ");
-        query.bind(1, original_url);
-        if (query. executeStep()) {
-            return query.getColumn(0). getText();
+    // Чужой X-Cluster-Forwarded удаляется, чтобы обработчики его не видели
+    void acceptForwardedHeader() {
+        const auto header = request_.find(CLUSTER_FORWARDED_HEADER);
+        forwarded_ = header != request_.end() && peers_.contains(remote_);
+        if (header != request_.end() && !forwarded_) {
+            request_.erase(header);
         }
+    }
 
-        std::string short_code;
-        int max_attempts = 10;
-        for (int i = 0; i < max_attempts; ++i) {
-            short_code = CodeGenerator::generate();
-            try {
-                SQLite::Statement insert(db_,
-                    "INSERT INTO urls (short_code, original_url) VALUES (?, ?)");
-                insert.bind(1, short_code);
-                insert.bind(2, original_url);
-                insert. exec();
-                return short_code;
-            } catch (const SQLite::Exception& e) {
-                if (i == max_attempts - 1) throw;
+    // По таймауту basic_stream уже закрыл сокет; на превышение лимита
+    // отвечаем и закрываем соединение, недочитанный запрос не разбираем
+    void readFailed(beast::error_code ec, SessionLimit timeout) {
+        if (ec == http::error::end_of_stream) {
+            close();
+        } else if (ec == beast::error::timeout) {
+            Metrics::instance().sessionTerminated(timeout);
+        } else if (ec == http::error::header_limit) {
+            rejectRequest(SessionLimit::HeaderTooLarge, http::status::request_header_fields_too_large,
+                          "Request header is too large");
+        } else if (ec == http::error::body_limit) {
+            rejectRequest(SessionLimit::BodyTooLarge, http::status::payload_too_large,
+                          "Request body is too large");
+        }
+    }
+
+    void rejectRequest(SessionLimit limit, http::status status, std::string_view body) {
+        Metrics::instance().sessionTerminated(limit);
+        request_ = parser_->release();
+        parser_.reset();
+        request_.keep_alive(false);
+        route_ = Route::BadRequest;
+        started_ = std::chrono::steady_clock::now();
+        sendResponse(status, body);
+    }
+
+    void close() {
+        beast::error_code ec;
+        stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+    }
+
+    void processRequest() {
+        started_ = std::chrono::steady_clock::now();
+
+        try {
+            const auto target = request_.target();
+            const RouteMatch match = Router::match(request_.method(),
+                                                   std::string_view(target.data(), target.size()));
+            route_ = match.route;
+
+            if (rateLimited(match.route)) {
+                Metrics::instance().rateLimited();
+                sendRetryLater(http::status::too_many_requests, "Too many requests");
+                return;
+            }
+
+            switch (match.route) {
+            case Route::Shorten:
+                shortenAsync(urlDecode(match.argument));
+                return;
+
+            case Route::ShortenBatch:
+                shortenBatchAsync();
+                return;
+
+            case Route::Resolve:
+                resolveAsync(std::string(match.argument));
+                return;
+
+            case Route::ResolveBatch:
+                resolveBatchAsync();
+                return;
+
+            case Route::Health:
+                // Пока кэш прогревается, балансировщик не шлёт сюда трафик
+                if (!storage_->ready()) {
+                    sendRetryLater(http::status::service_unavailable, "Warming up cache");
+                    return;
+                }
+                sendResponse(http::status::ok, RUNNING_MESSAGE
+                    + "\n\nCache: hits=" + std::to_string(Metrics::instance().cacheHits())
+                    + ", misses=" + std::to_string(Metrics::instance().cacheMisses()));
+                return;
+
+            case Route::Metrics:
+                sendResponse(http::status::ok, Metrics::instance().render(), "text/plain; version=0.0.4");
+                return;
+
+            case Route::BadRequest:
+                sendResponse(http::status::bad_request, "Invalid request.  Use /makeshort/<url> or /<code>");
+                return;
             }
+
+        } catch (const std::exception& e) {
+            sendResponse(http::status::internal_server_error, std::string("Error: ") + e.what());
         }
-        throw std::runtime_error("Failed to generate unique short code");
     }
 
-    std::string getOriginalUrl(const std::string& short_code) {
-        SQLite::Statement query(db_, "SELECT original_url FROM urls WHERE short_code = ? ");
-        query. bind(1, short_code);
-        if (query.executeStep()) {
-            return query.getColumn(0).getText();
+    // Срок ссылки из X-Link-TTL (секунды от текущего момента) или
+    // X-Link-Expires-At (unix-время); 0 — бессрочная. std::nullopt — заголовок
+    // неверен, ответ 400 уже отправлен.
+    std::optional<std::int64_t> linkExpiry() {
+        const auto ttl = request_.find(LINK_TTL_HEADER);
+        const auto expires = request_.find(LINK_EXPIRES_AT_HEADER);
+        if (ttl == request_.end() && expires == request_.end()) {
+            return 0;
+        }
+
+        const auto text = (ttl != request_.end() ? ttl : expires)->value();
+        std::int64_t expires_at = 0;
+        const auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), expires_at);
+        const std::int64_t now = unixNow();
+        bool valid = ec == std::errc() && end == text.data() + text.size();
+        if (valid && ttl != request_.end()) {
+            // Ограничение до сложения: now + TTL не должно переполниться
+            valid = expires_at > 0 && expires_at <= MAX_LINK_EXPIRES_AT;
+            expires_at += now;
+        }
+        if (!valid || expires_at <= now || expires_at > MAX_LINK_EXPIRES_AT) {
+            sendResponse(http::status::bad_request, "Link expiry must be a time in the future");
+            return std::nullopt;
         }
-        return "";
+        return expires_at;
     }
 
-private:
-    SQLite::Database db_;
+    void shortenAsync(std::string original_url) {
+        const auto expires_at = linkExpiry();
+        if (!expires_at) {
+            return;
+        }
+        auto self = shared_from_this();
+        storage().shortenUrlAsync(std::move(original_url), *expires_at,
+            [self](std::string short_code, std::exception_ptr error) {
+                net::post(self->stream_.get_executor(),
+                    [self, short_code = std::move(short_code), error] {
+                        if (error) {
+                            self->sendError(error);
+                            return;
+                        }
+                        self->sendShortUrl(short_code);
+                    });
+            });
+    }
+
+    // Кэш и фильтр отвечают сразу, в потоке ввода-вывода; за SQLite запрос
+    // уходит в пул чтения, а сессия продолжает работу на своём strand
+    void resolveAsync(std::string short_code) {
+        if (const auto found = storage().tryGetOriginalUrl(short_code, url_buffer_)) {
+            sendResolved(*found);
+            return;
+        }
+
+        auto self = shared_from_this();
+        storage().getOriginalUrlAsync(std::move(short_code),
+            [self](Lookup result, std::string original_url, std::exception_ptr error) {
+                net::post(self->stream_.get_executor(),
+                    [self, result, original_url = std::move(original_url), error]() mutable {
+                        if (error) {
+                            self->sendError(error);
+                            return;
+                        }
+                        self->url_buffer_.swap(original_url);
+                        self->sendResolved(result);
+                    });
+            });
+    }
+
+    void sendResolved(Lookup result) {
+        if (result == Lookup::Missing) {
+            sendResponse(http::status::not_found, "Short URL not found");
+            return;
+        }
+        if (result == Lookup::Expired) {
+            sendResponse(http::status::gone, "Short URL has expired");
+            return;
+        }
+        recordClick();
+        if (Config::current().redirect_status != 0
+                   && url_buffer_.find_first_of("\r\n") == std::string::npos) {
+            sendRedirect(url_buffer_);
+        } else {
+            sendResponse(http::status::ok, url_buffer_);
+        }
+    }
+
+    // Код берётся из target: запрос не очищается до отправки ответа.
+    // Пересланный переход уже учтён узлом, принявшим запрос клиента.
+    void recordClick() {
+        if (!clicks_ || forwarded_) {
+            return;
+        }
+        const auto target = request_.target();
+        const auto referrer = request_[http::field::referer];
+        clicks_->record(std::string_view(target.data(), target.size()).substr(1),
+                        std::string_view(referrer.data(), referrer.size()));
+    }
+
+    void shortenBatchAsync() {
+        const auto content_type = request_[http::field::content_type];
+        const BatchFormat format = BatchFormat::detect(
+            std::string_view(content_type.data(), content_type.size()), request_.body());
+
+        std::vector<std::string> original_urls;
+        try {
+            original_urls = format.parse(request_.body());
+        } catch (const std::invalid_argument& e) {
+            sendResponse(http::status::bad_request, e.what());
+            return;
+        }
+        if (std::find(original_urls.begin(), original_urls.end(), std::string{}) != original_urls.end()) {
+            sendResponse(http::status::bad_request, "Batch contains an empty URL");
+            return;
+        }
+        const auto expires_at = linkExpiry();
+        if (!expires_at) {
+            return;
+        }
+
+        auto self = shared_from_this();
+        storage().shortenUrlsAsync(std::move(original_urls), *expires_at,
+            [self, format](std::vector<std::string> short_codes, std::exception_ptr error) {
+                net::post(self->stream_.get_executor(),
+                    [self, format, short_codes = std::move(short_codes), error] {
+                        if (error) {
+                            self->sendError(error);
+                            return;
+                        }
+
+                        const std::string& short_domain = Config::current().short_domain;
+                        std::string body;
+                        body.reserve(short_codes.size() * (short_domain.size() + MAX_SHORT_CODE_LENGTH + 4) + 2);
+                        format.begin(body);
+                        std::string short_url;
+                        for (std::size_t i = 0; i < short_codes.size(); ++i) {
+                            short_url = short_domain + "/" + short_codes[i];
+                            format.append(body, &short_url, i == 0);
+                        }
+                        format.end(body);
+                        self->sendResponse(http::status::ok, body, format.contentType());
+                    });
+            });
+    }
+
+    void resolveBatchAsync() {
+        const auto content_type = request_[http::field::content_type];
+        const BatchFormat format = BatchFormat::detect(
+            std::string_view(content_type.data(), content_type.size()), request_.body());
+
+        std::vector<std::string> short_codes;
+        try {
+            short_codes = format.parse(request_.body());
+        } catch (const std::invalid_argument& e) {
+            sendResponse(http::status::bad_request, e.what());
+            return;
+        }
+
+        auto self = shared_from_this();
+        storage().getOriginalUrlsAsync(std::move(short_codes),
+            [self, format](std::vector<std::string> original_urls, std::exception_ptr error) {
+                net::post(self->stream_.get_executor(),
+                    [self, format, original_urls = std::move(original_urls), error] {
+                        if (error) {
+                            self->sendError(error);
+                            return;
+                        }
+
+                        std::string body;
+                        format.begin(body);
+                        for (std::size_t i = 0; i < original_urls.size(); ++i) {
+                            format.append(body, original_urls[i].empty() ? nullptr : &original_urls[i], i == 0);
+                        }
+                        format.end(body);
+                        self->sendResponse(http::status::ok, body, format.contentType());
+                    });
+            });
+    }
+
+    void sendError(std::exception_ptr error) {
+        try {
+            std::rethrow_exception(error);
+        } catch (const OverloadedError& e) {
+            sendRetryLater(http::status::service_unavailable, e.what());
+        } catch (const std::exception& e) {
+            sendResponse(http::status::internal_server_error, std::string("Error: ") + e.what());
+        }
+    }
+
+    // Поля прошлого ответа удаляются, а их память возвращается в арену
+    void resetResponse(http::status status, std::string_view content_type) {
+        response_.clear();
+        response_.result(status);
+        response_.version(request_.version());
+        response_.set(http::field::server, "URLShortener/1.0");
+        if (!content_type.empty()) {
+            response_.set(http::field::content_type,
+                          beast::string_view(content_type.data(), content_type.size()));
+        }
+        response_.body().clear();
+    }
+
+    void sendResponse(http::status status, std::string_view body,
+                      std::string_view content_type = "text/plain") {
+        resetResponse(status, content_type);
+        response_.body().append(body.data(), body.size());
+        writeResponse();
+    }
+
+    void sendRetryLater(http::status status, std::string_view body) {
+        resetResponse(status, "text/plain");
+        response_.set(http::field::retry_after, std::to_string(Config::current().retry_after.count()));
+        response_.body().append(body.data(), body.size());
+        writeResponse();
+    }
+
+    void sendShortUrl(std::string_view short_code) {
+        resetResponse(http::status::ok, "text/plain");
+        response_.body().append(Config::current().short_domain).append(1, '/').append(short_code.data(), short_code.size());
+        writeResponse();
+    }
+
+    void sendRedirect(std::string_view location) {
+        resetResponse(static_cast<http::status>(Config::current().redirect_status), {});
+        response_.set(http::field::location, beast::string_view(location.data(), location.size()));
+        response_.set(http::field::cache_control, Config::current().redirect_cache_control);
+        writeResponse();
+    }
+
+    void writeResponse() {
+        response_.keep_alive(request_.keep_alive());
+        response_.prepare_payload();
+
+        stream_.expires_after(Config::current().session_write_timeout);
+
+        auto self = shared_from_this();
+        http::async_write(stream_, response_, recycling(
+            [self](beast::error_code ec, std::size_t) {
+                Metrics::instance().observeRequest(self->route_, std::chrono::steady_clock::now() - self->started_);
+                if (ec == beast::error::timeout) {
+                    Metrics::instance().sessionTerminated(SessionLimit::WriteTimeout);
+                }
+                if (ec) {
+                    return;
+                }
+                if (self->response_.need_eof()) {
+                    self->close();
+                    return;
+                }
+                self->readRequest();
+            }));
+    }
 };
 
-class Session : public std::enable_shared_from_this<Session> {
+enum class BinaryOpcode : std::uint8_t {
+    // Нагрузка — исходный URL, ответ — короткий код без домена
+    Shorten = 1,
+    // Нагрузка — короткий код, ответ — исходный URL
+    Resolve = 2,
+    // Нагрузка — [u32 срок жизни в секундах][исходный URL], ответ — как у Shorten
+    ShortenExpiring = 3,
+};
+
+enum class BinaryStatus : std::uint8_t {
+    Ok = 0,
+    NotFound = 1,
+    BadRequest = 2,
+    // Очередь записи переполнена, запрос стоит повторить позже
+    Overloaded = 3,
+    // Нагрузка — текст ошибки
+    Error = 4,
+    // Срок ссылки истёк
+    Expired = 5,
+};
+
+// Соединение бинарного протокола для внутренних сервисов. Запросы конвейерные:
+// клиент шлёт кадры не дожидаясь ответов, каждый обрабатывается сразу, а ответы
+// уходят по мере готовности — из кэша раньше, чем из SQLite — и сопоставляются
+// по id. Готовые за время записи ответы уходят следующей одной записью.
+// Ограничения частоты нет: порт не должен быть доступен извне.
+class BinarySession : public std::enable_shared_from_this<BinarySession> {
 public:
-    Session(tcp::socket socket, std::shared_ptr<Database> db)
-        : socket_(std::move(socket)), db_(db) {}
+    BinarySession(SessionSocket socket, std::shared_ptr<Storage> storage, ClickPipeline* clicks,
+                  AdmissionControl::Ticket admission)
+        : stream_(std::move(socket))
+        , storage_(std::move(storage))
+        , clicks_(clicks)
+        , admission_(std::move(admission)) {
+        Metrics::instance().sessionOpened();
+    }
+
+    ~BinarySession() {
+        Metrics::instance().sessionClosed();
+    }
 
     void start() {
-        readRequest();
+        read();
     }
 
 private:
-    tcp::socket socket_;
+    using Clock = std::chrono::steady_clock;
+
+    SessionStream stream_;
+    std::shared_ptr<Storage> storage_;
+    // nullptr — учёт переходов выключен
+    ClickPipeline* clicks_;
+    AdmissionControl::Ticket admission_;
     beast::flat_buffer buffer_;
-    http::request<http::string_body> request_;
-    std::shared_ptr<Database> db_;
+    // Ответы, готовые во время записи, и уходящие текущей записью
+    std::string pending_;
+    std::string writing_;
+    std::string url_buffer_;
+    std::size_t inflight_ = 0;
+    // Чтение приостановлено на binary_max_inflight запросах в обработке
+    bool paused_ = false;
+    // Клиент закончил передачу или кадрирование сломано: новых запросов не будет
+    bool input_done_ = false;
+    // По истечении срока ошибку получают и чтение, и запись; считаем один раз
+    bool terminated_ = false;
 
-    void readRequest() {
+    void read() {
+        if (input_done_) {
+            finishIfDone();
+            return;
+        }
+        stream_.expires_after(Config::current().session_idle_timeout);
         auto self = shared_from_this();
-        http::async_read(socket_, buffer_, request_,
-            [self](beast::error_code ec, std::size_t) {
-                if (! ec) {
-                    self->processRequest();
+        stream_.async_read_some(buffer_.prepare(beast::read_size(buffer_, 65536)),
+            [self](beast::error_code ec, std::size_t bytes) {
+                if (ec) {
+                    self->input_done_ = true;
+                    if (ec == beast::error::timeout) {
+                        self->terminate(SessionLimit::IdleTimeout);
+                    } else {
+                        self->finishIfDone();
+                    }
+                    return;
                 }
+                self->buffer_.commit(bytes);
+                self->parseFrames();
             });
     }
 
-    void processRequest() {
-        std::string target(request_.target());
-        std::string response_body;
-        http::status status = http::status::ok;
+    // Разбирает все целые кадры из буфера; асинхронное чтение начинается только
+    // после разбора, поэтому буфер не меняется под незавершённой операцией
+    void parseFrames() {
+        paused_ = false;
+        const Config& config = Config::current();
+        while (true) {
+            if (inflight_ >= config.binary_max_inflight) {
+                paused_ = true;
+                return;
+            }
+            const auto data = buffer_.data();
+            const char* bytes = static_cast<const char*>(data.data());
+            if (data.size() < 4) {
+                break;
+            }
+            const std::size_t length = readLittleEndian(bytes, 4);
+            if (length < BINARY_HEADER_SIZE || length > config.binary_frame_limit) {
+                rejectFrame(length > config.binary_frame_limit);
+                return;
+            }
+            if (data.size() < 4 + length) {
+                break;
+            }
+            const auto id = static_cast<std::uint32_t>(readLittleEndian(bytes + 4, 4));
+            const auto opcode = static_cast<BinaryOpcode>(bytes[8]);
+            std::string payload(bytes + 4 + BINARY_HEADER_SIZE, length - BINARY_HEADER_SIZE);
+            buffer_.consume(4 + length);
+            dispatch(id, opcode, std::move(payload));
+        }
+        read();
+    }
 
-        try {
-            std::regex shorten_regex(R"(^/makeshort/(.+)$)");
-            std::regex decode_regex(R"(/([a-zA-Z0-9]+)$)");
-            std::smatch match;
+    // После неверной длины границы следующих кадров неизвестны: отвечаем
+    // ошибкой с id 0 и закрываем соединение, дождавшись начатых запросов
+    void rejectFrame(bool too_large) {
+        if (too_large) {
+            Metrics::instance().sessionTerminated(SessionLimit::BodyTooLarge);
+        }
+        input_done_ = true;
+        buffer_.consume(buffer_.size());
+        ++inflight_;
+        respond(0, BinaryStatus::BadRequest, too_large ? "Frame is too large" : "Malformed frame",
+                Route::BadRequest, Clock::now());
+    }
 
-            if (std::regex_match(target, match, shorten_regex)) {
-                std::string original_url = match[1].str();
+    void dispatch(std::uint32_t id, BinaryOpcode opcode, std::string payload) {
+        ++inflight_;
+        const auto started = Clock::now();
+        switch (opcode) {
+        case BinaryOpcode::Shorten:
+            if (payload.empty()) {
+                break;
+            }
+            shorten(id, std::move(payload), 0, started);
+            return;
 
-                original_url = urlDecode(original_url);
+        case BinaryOpcode::ShortenExpiring: {
+            if (payload.size() <= 4) {
+                break;
+            }
+            const std::int64_t now = unixNow();
+            const std::int64_t expires_at = now + static_cast<std::int64_t>(readLittleEndian(payload.data(), 4));
+            if (expires_at == now || expires_at > MAX_LINK_EXPIRES_AT) {
+                break;
+            }
+            shorten(id, payload.substr(4), expires_at, started);
+            return;
+        }
 
-                std::string short_code = db_->shortenUrl(original_url);
-                response_body = SHORT_DOMAIN + "/" + short_code;
+        case BinaryOpcode::Resolve:
+            if (!Router::isShortCode(payload)) {
+                break;
+            }
+            resolve(id, std::move(payload), started);
+            return;
+        }
+        respond(id, BinaryStatus::BadRequest, "Invalid request", Route::BadRequest, started);
+    }
 
-            } else if (std::regex_match(target, match, decode_regex)) {
-                std::string short_code = match[1].str();
-                std::string original_url = db_->getOriginalUrl(short_code);
+    void shorten(std::uint32_t id, std::string original_url, std::int64_t expires_at, Clock::time_point started) {
+        auto self = shared_from_this();
+        storage_->shortenUrlAsync(std::move(original_url), expires_at,
+            [self, id, started](std::string short_code, std::exception_ptr error) {
+                net::post(self->stream_.get_executor(),
+                    [self, id, started, short_code = std::move(short_code), error] {
+                        if (error) {
+                            self->respondError(id, error, Route::Shorten, started);
+                            return;
+                        }
+                        self->respond(id, BinaryStatus::Ok, short_code, Route::Shorten, started);
+                    });
+            });
+    }
 
-                if (original_url.empty()) {
-                    status = http::status::not_found;
-                    response_body = "Short URL not found";
-                } else {
-                    response_body = original_url;
-                }
+    void resolve(std::uint32_t id, std::string short_code, Clock::time_point started) {
+        if (const auto found = storage_->tryGetOriginalUrl(short_code, url_buffer_)) {
+            resolved(id, short_code, *found, url_buffer_, started);
+            return;
+        }
 
-            } else if (target == "/" || target == "/health") {
-                response_body = RUNNING_MESSAGE;
+        auto self = shared_from_this();
+        storage_->getOriginalUrlAsync(short_code,
+            [self, id, started, short_code](Lookup result, std::string original_url, std::exception_ptr error) {
+                net::post(self->stream_.get_executor(),
+                    [self, id, started, short_code, result, original_url = std::move(original_url), error] {
+                        if (error) {
+                            self->respondError(id, error, Route::Resolve, started);
+                            return;
+                        }
+                        self->resolved(id, short_code, result, original_url, started);
+                    });
+            });
+    }
 
-            } else {
-                status = http::status::bad_request;
-                response_body = "Invalid request.  Use /makeshort/<url> or /<code>";
-            }
+    void resolved(std::uint32_t id, std::string_view short_code, Lookup result, std::string_view original_url,
+                  Clock::time_point started) {
+        if (result != Lookup::Found) {
+            respond(id, result == Lookup::Expired ? BinaryStatus::Expired : BinaryStatus::NotFound, {},
+                    Route::Resolve, started);
+            return;
+        }
+        if (clicks_) {
+            clicks_->record(short_code, {});
+        }
+        respond(id, BinaryStatus::Ok, original_url, Route::Resolve, started);
+    }
 
+    void respondError(std::uint32_t id, std::exception_ptr error, Route route, Clock::time_point started) {
+        try {
+            std::rethrow_exception(error);
+        } catch (const OverloadedError& e) {
+            respond(id, BinaryStatus::Overloaded, e.what(), route, started);
         } catch (const std::exception& e) {
-            status = http::status::internal_server_error;
-            response_body = std::string("Error: ") + e.what();
+            respond(id, BinaryStatus::Error, e.what(), route, started);
         }
+    }
 
-        sendResponse(status, response_body);
+    void respond(std::uint32_t id, BinaryStatus status, std::string_view payload, Route route,
+                 Clock::time_point started) {
+        --inflight_;
+        appendLittleEndian(pending_, BINARY_HEADER_SIZE + payload.size(), 4);
+        appendLittleEndian(pending_, id, 4);
+        pending_ += static_cast<char>(status);
+        pending_.append(payload.data(), payload.size());
+        Metrics::instance().observeRequest(route, Clock::now() - started);
+        flush();
+        if (paused_ && inflight_ < Config::current().binary_max_inflight) {
+            parseFrames();
+        }
     }
 
-    std::string urlDecode(const std::string& encoded) {
-        std::string decoded;
-        for (size_t i = 0; i < encoded.size(); ++i) {
-            if (encoded[i] == '%' && i + 2 < encoded.size()) {
-                int value;
-                std::istringstream iss(encoded.substr(i + 1, 2));
-                if (iss >> std::hex >> value) {
-                    decoded += static_cast<char>(value);
-                    i += 2;
-                } else {
-                    decoded += encoded[i];
+    void flush() {
+        if (!writing_.empty() || pending_.empty()) {
+            return;
+        }
+        writing_.swap(pending_);
+        stream_.expires_after(Config::current().session_write_timeout);
+        auto self = shared_from_this();
+        net::async_write(stream_, net::buffer(writing_), [self](beast::error_code ec, std::size_t) {
+            self->writing_.clear();
+            if (ec) {
+                self->input_done_ = true;
+                if (ec == beast::error::timeout) {
+                    self->terminate(SessionLimit::WriteTimeout);
                 }
-            } else if (encoded[i] == '+') {
-                decoded += ' ';
-            } else {
-                decoded += encoded[i];
+                return;
             }
-        }
-        return decoded;
+            if (self->pending_.empty()) {
+                // Срок записи действовал и для ожидающего чтения
+                self->stream_.expires_after(Config::current().session_idle_timeout);
+            }
+            self->flush();
+            self->finishIfDone();
+        });
     }
 
-    void sendResponse(http::status status, const std::string& body) {
-        auto response = std::make_shared<http::response<http::string_body>>(status, request_. version());
-        response->set(http::field::server, "URLShortener/1.0");
-        response->set(http::field::content_type, "text/plain");
-        response->keep_alive(request_.keep_alive());
-        response->body() = body;
-        response->prepare_payload();
+    void terminate(SessionLimit limit) {
+        if (!terminated_) {
+            terminated_ = true;
+            Metrics::instance().sessionTerminated(limit);
+        }
+    }
 
-        auto self = shared_from_this();
-        http::async_write(socket_, *response,
-            [self, response](beast::error_code ec, std::size_t) {
-                self->socket_.shutdown(tcp::socket::shutdown_send, ec);
-            });
+    void finishIfDone() {
+        if (input_done_ && inflight_ == 0 && writing_.empty() && pending_.empty()) {
+            beast::error_code ec;
+            stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+        }
     }
 };
 
+unsigned workerThreadCount() {
+    if (Config::current().worker_threads > 0) {
+        return Config::current().worker_threads;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+unsigned acceptorCount() {
+    return Config::current().acceptors > 0 ? Config::current().acceptors : workerThreadCount();
+}
+
+// Потоки общего io_context. Если слушающих сокетов несколько, соединения
+// обслуживают их собственные потоки, и общему контексту остаются сигналы.
+unsigned sharedIoThreadCount() {
+    return acceptorCount() > 1 ? 1 : workerThreadCount();
+}
+
 class Server {
 public:
     Server(net::io_context& ioc, unsigned short port)
         : ioc_(ioc)
-        , acceptor_(ioc, tcp::endpoint(tcp::v4(), port))
-        , db_(std::make_shared<Database>()) {
-        doAccept();
+        , storage_(makeStorage()) {
+        if (Config::current().rate_limiting) {
+            limiter_ = std::make_unique<RateLimiter>();
+        }
+        if (Config::current().replication_port != 0) {
+            const Config& config = Config::current();
+            const std::string& address = config.replication_address.empty()
+                ? config.listen_address : config.replication_address;
+            replication_ = std::make_unique<ReplicationServer>(config.db_path,
+                tcp::endpoint(net::ip::make_address(address), config.replication_port));
+        }
+        if (Config::current().click_tracking && storage_->recordsClicks()) {
+            clicks_ = std::make_unique<ClickPipeline>(storage_);
+        }
+        const unsigned count = acceptorCount();
+        if (count > 1) {
+            for (unsigned i = 0; i < count; ++i) {
+                loops_.push_back(std::make_unique<IoLoop>());
+            }
+        }
+        openAcceptors(acceptors_, port);
+        for (std::size_t i = 0; i < acceptors_.size(); ++i) {
+            doAccept(acceptors_[i], loop(i), &Server::admit);
+        }
+        if (Config::current().binary_port != 0) {
+            openAcceptors(binary_acceptors_, Config::current().binary_port);
+            for (std::size_t i = 0; i < binary_acceptors_.size(); ++i) {
+                doAccept(binary_acceptors_[i], loop(i), &Server::admitBinary);
+            }
+        }
+        for (auto& io_loop : loops_) {
+            io_loop->thread = std::thread([&ioc = io_loop->ioc] { ioc.run(); });
+        }
+    }
+
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    ~Server() {
+        for (auto& io_loop : loops_) {
+            io_loop->ioc.stop();
+        }
+        for (auto& io_loop : loops_) {
+            if (io_loop->thread.joinable()) {
+                io_loop->thread.join();
+            }
+        }
+    }
+
+    void saveHotSet() {
+        storage_->saveHotSet();
     }
 
 private:
+    // Параметры сокетов, для которых в Asio нет готовых типов
+    using ReusePort = net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+    using TcpFastOpen = net::detail::socket_option::integer<IPPROTO_TCP, TCP_FASTOPEN>;
+
+    // Поток со своим io_context: слушающий сокет с этим номером на каждом
+    // порту и все принятые им соединения живут только в нём
+    struct IoLoop {
+        net::io_context ioc{1};
+        std::thread thread;
+    };
+
     net::io_context& ioc_;
-    tcp::acceptor acceptor_;
-    std::shared_ptr<Database> db_;
+    // Пусто при одном слушающем сокете: тогда всё работает в общем ioc_.
+    // Объявлены до сокетов, чтобы сокеты разрушались раньше своих контекстов.
+    std::vector<std::unique_ptr<IoLoop>> loops_;
+    // Заполняется один раз в конструкторе: обработчики accept держат ссылки на элементы
+    std::vector<tcp::acceptor> acceptors_;
+    std::vector<tcp::acceptor> binary_acceptors_;
+    std::shared_ptr<Storage> storage_;
+    std::unique_ptr<ReplicationServer> replication_;
+    std::unique_ptr<ClickPipeline> clicks_;
+    std::unique_ptr<RateLimiter> limiter_;
+    ClusterPeers peers_;
+    AdmissionControl admission_;
+
+    void openAcceptors(std::vector<tcp::acceptor>& acceptors, unsigned short port) {
+        const Config& config = Config::current();
+        const tcp::endpoint endpoint(net::ip::make_address(config.listen_address), port);
+        const unsigned count = acceptorCount();
+        acceptors.reserve(count);
+        for (unsigned i = 0; i < count; ++i) {
+            tcp::acceptor& acceptor = acceptors.emplace_back(loop(i));
+            acceptor.open(endpoint.protocol());
+            acceptor.set_option(net::socket_base::reuse_address(true));
+            if (count > 1) {
+                acceptor.set_option(ReusePort(true));
+            }
+            if (endpoint.address().is_v6()) {
+                acceptor.set_option(net::ip::v6_only(false));
+            }
+            if (config.tcp_fastopen_queue > 0) {
+                beast::error_code ec;
+                acceptor.set_option(TcpFastOpen(config.tcp_fastopen_queue), ec);
+                if (ec && i == 0) {
+                    std::cerr << "TCP Fast Open is unavailable: " << ec.message() << std::endl;
+                }
+            }
+            acceptor.bind(endpoint);
+            acceptor.listen(config.listen_backlog);
+            // Для async_accept это ничего не меняет, а дочитывающий accept
+            // возвращает would_block вместо блокировки потока
+            acceptor.non_blocking(true);
+        }
+    }
+
+    net::io_context& loop(std::size_t index) {
+        return loops_.empty() ? ioc_ : loops_[index]->ioc;
+    }
 
-    void doAccept() {
-        acceptor_.async_accept(
-            [this](beast::error_code ec, tcp::socket socket) {
+    using Admit = void (Server::*)(SessionSocket socket);
+
+    // Соединение остаётся в контексте принявшего его сокета
+    void doAccept(tcp::acceptor& acceptor, net::io_context& ioc, Admit admit) {
+        acceptor.async_accept(net::make_strand(ioc),
+            [this, &acceptor, &ioc, admit](beast::error_code ec, SessionSocket socket) {
                 if (!ec) {
-                    std::make_shared<Session>(std::move(socket), db_)->start();
+                    configure(socket);
+                    (this->*admit)(std::move(socket));
+                    // При шквале соединений забираем их из очереди listen подряд,
+                    // не возвращаясь каждый раз в реактор
+                    const std::size_t batch = Config::current().accept_batch;
+                    for (std::size_t i = 1; i < batch; ++i) {
+                        SessionSocket next = acceptor.accept(net::make_strand(ioc), ec);
+                        if (ec) {
+                            break;
+                        }
+                        configure(next);
+                        (this->*admit)(std::move(next));
+                    }
                 }
-                doAccept();
+                doAccept(acceptor, ioc, admit);
             });
     }
+
+    static void configure(SessionSocket& socket) {
+        if (Config::current().tcp_nodelay) {
+            beast::error_code ec;
+            socket.set_option(tcp::no_delay(true), ec);
+        }
+    }
+
+    void admit(SessionSocket socket) {
+        if (auto ticket = admission_.tryAdmit()) {
+            std::allocate_shared<Session>(RecyclingAllocator<Session>(), std::move(socket), storage_,
+                                          clicks_.get(), limiter_.get(), peers_, std::move(*ticket))->start();
+        } else {
+            rejectConnection(socket);
+        }
+    }
+
+    // Ответа без id запроса в бинарном протоколе нет: сверх max_sessions
+    // соединение просто закрывается
+    void admitBinary(SessionSocket socket) {
+        if (auto ticket = admission_.tryAdmit()) {
+            std::make_shared<BinarySession>(std::move(socket), storage_, clicks_.get(), std::move(*ticket))->start();
+        } else {
+            Metrics::instance().connectionRejected();
+            beast::error_code ec;
+            socket.close(ec);
+        }
+    }
+
+    // Без сессии и буферов: готовый ответ уходит одной неблокирующей записью,
+    // которая умещается в буфер отправки сокета, и соединение закрывается
+    static void rejectConnection(SessionSocket& socket) {
+        const std::string response =
+            "HTTP/1.1 503 Service Unavailable\r\n"
+            "Server: URLShortener/1.0\r\n"
+            "Content-Type: text/plain\r\n"
+            "Retry-After: " + std::to_string(Config::current().retry_after.count()) + "\r\n"
+            "Connection: close\r\n"
+            "Content-Length: 19\r\n"
+            "\r\n"
+            "Server is too busy\n";
+        Metrics::instance().connectionRejected();
+        beast::error_code ec;
+        socket.non_blocking(true, ec);
+        socket.write_some(net::buffer(response), ec);
+        socket.shutdown(tcp::socket::shutdown_both, ec);
+        socket.close(ec);
+    }
 };
 
-int main() {
+// SIGHUP перечитывает настройки; при ошибке в новых значениях действуют прежние
+void watchConfigReload(net::signal_set& signals) {
+    signals.async_wait([&signals](const beast::error_code& ec, int) {
+        if (ec) {
+            return;
+        }
+        try {
+            Config::reload();
+            std::cout << "Config reloaded" << std::endl;
+        } catch (const std::exception& e) {
+            std::cerr << "Config: reload failed: " << e.what() << std::endl;
+        }
+        watchConfigReload(signals);
+    });
+}
+
+// Бенчмарки подключают этот файл целиком с URL_SHORTENER_NO_MAIN
+#ifndef URL_SHORTENER_NO_MAIN
+int main(int argc, char* argv[]) {
     try {
+        Config::load(argc, argv);
+        // Всё, что не --<ключ>=<значение>, — подкоманда и её аргументы
+        std::vector<std::string> positional;
+        for (int i = 1; i < argc; ++i) {
+            if (std::string_view(argv[i]).rfind("--", 0) != 0) {
+                positional.emplace_back(argv[i]);
+            }
+        }
+
+        // url_shortener export-snapshot [urls.db] [urls.snapshot]
+        if (!positional.empty() && positional[0] == "export-snapshot") {
+            const std::string db_path = positional.size() >= 2 ? positional[1] : Config::current().db_path;
+            const std::string snapshot_path = positional.size() >= 3 ? positional[2] : Config::current().snapshot_path;
+            const std::uint64_t count = exportSnapshot(db_path, snapshot_path);
+            std::cout << "Exported " << count << " URL(s) to " << snapshot_path << std::endl;
+            return 0;
+        }
+
+        const unsigned threads = sharedIoThreadCount();
+
         std::cout << "=== URL Shortener Service ===" << std::endl;
-        std::cout << "Starting server on port " << SERVER_PORT << "..." << std::endl;
+        std::cout << "Starting server on " << Config::current().listen_address << " port "
+                  << Config::current().server_port << " with " << std::max(threads, acceptorCount())
+                  << " worker thread(s)..." << std::endl;
 
-        net::io_context ioc{1};
-        Server server(ioc, SERVER_PORT);
+        net::io_context ioc{static_cast<int>(threads)};
+        Server server(ioc, Config::current().server_port);
+        net::signal_set reload_signals(ioc, SIGHUP);
+        watchConfigReload(reload_signals);
+        // По SIGINT/SIGTERM потоки останавливаются, и горячие коды кэша
+        // сохраняются для прогрева при следующем старте
+        net::signal_set stop_signals(ioc, SIGINT, SIGTERM);
+        stop_signals.async_wait([&ioc](const beast::error_code& ec, int) {
+            if (!ec) {
+                ioc.stop();
+            }
+        });
 
         std::cout << RUNNING_MESSAGE << std::endl;
 
+        std::vector<std::thread> workers;
+        workers.reserve(threads - 1);
+        for (unsigned i = 1; i < threads; ++i) {
+            workers.emplace_back([&ioc] { ioc.run(); });
+        }
         ioc.run();
 
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        std::cout << "Shutting down..." << std::endl;
+        server.saveHotSet();
+
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
     }
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,92 @@
+// Проверка пакетных эндпоинтов через HTTP: сервис поднимается в процессе на
+// хранилище в памяти, ответы сверяются построчно с запросами.
+#define URL_SHORTENER_NO_MAIN
+#include "../main.cpp"
+
+#include <cstdlib>
+
+namespace {
+
+const std::string TEST_PORT = "18089";
+
+int failures = 0;
+
+void check(bool condition, const std::string& what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+http::response<http::string_body> post(const std::string& target, const std::string& body) {
+    net::io_context ioc;
+    tcp::resolver resolver(ioc);
+    beast::tcp_stream stream(ioc);
+    stream.connect(resolver.resolve("127.0.0.1", TEST_PORT));
+
+    http::request<http::string_body> request{http::verb::post, target, 11};
+    request.set(http::field::host, "127.0.0.1");
+    request.set(http::field::content_type, "text/plain");
+    request.body() = body;
+    request.prepare_payload();
+    http::write(stream, request);
+
+    beast::flat_buffer buffer;
+    http::response<http::string_body> response;
+    http::read(stream, buffer, response);
+    beast::error_code ec;
+    stream.socket().shutdown(tcp::socket::shutdown_both, ec);
+    return response;
+}
+
+std::string codeOf(const std::string& short_url) {
+    return short_url.substr(short_url.rfind('/') + 1);
+}
+
+void shortenBatchRejectsBlankLine() {
+    const auto response = post("/makeshort/batch", "https://a.example\n\nhttps://b.example\n");
+    check(response.result() == http::status::bad_request, "/makeshort/batch with a blank line answers 400");
+}
+
+void resolveBatchKeepsBlankLines() {
+    const auto shortened = post("/makeshort/batch", "https://a.example\r\nhttps://b.example\n");
+    check(shortened.result() == http::status::ok, "/makeshort/batch answers 200");
+    const auto urls = BatchFormat(false).parseResults(shortened.body());
+    check(urls.size() == 2, "/makeshort/batch answers one line per URL");
+    if (urls.size() != 2) {
+        return;
+    }
+
+    const std::string body = codeOf(urls[0]) + "\n\nzzzzzzz\n" + codeOf(urls[1]) + "\n";
+    const auto resolved = post("/resolve/batch", body);
+    check(resolved.result() == http::status::ok, "/resolve/batch answers 200");
+    check(resolved.body() == "https://a.example\n\n\nhttps://b.example\n",
+          "/resolve/batch answers line by line, got: " + resolved.body());
+}
+
+}  // namespace
+
+int main() {
+    try {
+        std::string port_argument = "--server_port=" + TEST_PORT;
+        std::string engine_argument = "--storage_engine=memory";
+        std::string address_argument = "--listen_address=127.0.0.1";
+        char program[] = "batch_test";
+        char* argv[] = {program, port_argument.data(), engine_argument.data(), address_argument.data()};
+        Config::load(4, argv);
+
+        net::io_context ioc;
+        Server server(ioc, Config::current().server_port);
+        std::thread worker([&ioc] { ioc.run(); });
+
+        shortenBatchRejectsBlankLine();
+        resolveBatchKeepsBlankLines();
+
+        ioc.stop();
+        worker.join();
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -6,12 +6,21 @@ import requests
 app = Flask(__name__)
 app.secret_key = os.getenv("SECRET_KEY", 'dev-default-key')
 
-def make_cpp_request(request: str) -> str:
+# Общая сессия держит keep-alive соединения с C++ бэкендом
+cpp_session = requests.Session()
+
+def make_cpp_request(path: str) -> str:
+    # Бэкенд ограничивает частоту запросов по адресу клиента, а не фронтенда
+    headers = {"X-Forwarded-For": request.remote_addr or ""}
     try:
-        response = requests.get("http://localhost:8080/" + request, timeout=(2, 5))
+        response = cpp_session.get("http://localhost:8080/" + path, timeout=(2, 5),
+                                   headers=headers, allow_redirects=False)
         response.raise_for_status()
     except requests.exceptions.RequestException:
         return ""
+    # Бэкенд в режиме редиректа отдаёт исходный URL в Location
+    if response.is_redirect:
+        return response.headers.get("Location", "")
     return response.text
 
 def get_short_url(original_url: str) -> str: